@@ -14,6 +14,8 @@
  *      30. cxb3 Ne7 31. bxa4 Nd5 32. dxc5 Nb6 33. cxb6 Kb8 34. bxa7 Ka8
  *
  *  Reference: YouTube Channel Xadrez Brasil https://www.youtube.com/watch?v=5W-w31_95As
+ *
+ *  Build: g++ -O2 -pthread kuwait_chess.cpp -o kc (add -mbmi2 for PEXT slider attacks)
  */
 
 #include "kuwait_chess.hpp"
@@ -26,31 +28,184 @@
 #include <cstring>
 #include <vector>
 #include <csignal>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <bits/stdc++.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 bool goal_is_mate = false;
 bool goal_is_draw = false;
 bool goal_is_chessboard = false;
+problem_rules rules; // frozen pieces, captures and move directions of the problem, see compile_rules
+bool problem_restrictions = false; // the rules restrict the moves, see rule_restrictions
+char const *rules_name = NULL;
+char const *known_line = NULL; // moves to the final chessboard, whose move count bounds the search
+long probe_nodes = 0; // nodes of the probe for a line to the final chessboard (no probe if not set)
 char const *initial_fen = "";
 char const *final_fen = "";
 game_state initial_game;
 int  initial_side_to_move = WHITE;
 char initial_chessboard[NUM_SQUARES];
 char final_chessboard[NUM_SQUARES];
-long variants_analyzed  = 0;
-char last_variant_analyzed[4000] = {0};
-int  min_move_count_mate = 9999;
-int  min_move_count_draw = 9999;
-int  min_move_count_chessboard = 9999;
+game_state final_game;
+int  final_material[2][NUM_MATERIAL_TYPES]; // material of the final chessboard, for the reachability rules
+thread_local long variants_analyzed  = 0; // search state is kept per search thread and merged in serial order
+thread_local game_state *current_game = NULL; // variant being searched, rendered on demand by the reports
+thread_local int  min_move_count_mate = 9999;
+thread_local int  min_move_count_draw = 9999;
+thread_local int  min_move_count_chessboard = 9999;
 int  max_full_move_count = 9999;
-vector<string> mate_variant;
-vector<string> draw_variant;
-vector<string> chessboard_variant;
+thread_local variant_trie mate_variant;
+thread_local variant_trie draw_variant;
+thread_local variant_trie chessboard_variant;
+game_state variant_root_game; // initial chessboard of the stored variants, replayed when they are printed
 FILE *save_results = NULL;
 char const *save_results_name = "kuwait_chess.txt";
-int verbose = 1;
+char const *checkpoint_name = NULL; // search frontier, written every CHECKPOINT_VARIANTS variants
+char const *resume_name = NULL;
+char const *work_units_name = NULL; // work units of a search split over several processes
+int  work_units_ply = 0; // ply where the work units are split (0 = no split)
+int  work_unit = -1; // work unit searched by this process (-1 = none)
+bool merge_work_units = false;
+long next_checkpoint_variants = CHECKPOINT_VARIANTS;
+vector<search_frame> resume_frames; // frames read from the checkpoint, replayed when the search starts
+vector<valid_move_list> resume_move_lists;
+thread_local int verbose = 1;
+double transposition_table_gib = 0.0;
+double proof_number_gib = 0.0; // node store of the proof-number search (exhaustive search if not set)
+pn_node *pn_nodes = NULL;
+int pn_capacity = 0;
+int pn_used = 0; // nodes taken from the store, some of them freed since
+vector<int> pn_free_nodes; // freed nodes, whose children are freed when they are reused
+bool move_count_upper_bound = false; // the proof-number search could not show that its move count is the minimum
+transposition_entry *transposition_table = NULL;
+uint64_t transposition_table_mask = 0;
+thread_local long transposition_hits = 0;
+thread_local long transposition_misses = 0;
+thread_local long transposition_overwrites = 0;
+thread_local long repetition_draws = 0;
+thread_local long heap_allocations = 0; // operator new calls, which the search loop should not make once its depth is reached
+thread_local vector<valid_move_list *> ply_move_lists; // valid moves of each ply of the search, allocated when the ply is first reached
+thread_local vector<search_frame *> search_frames; // state of each ply of the search, allocated in the same way
+thread_local undo_record game_history[MAX_GAME_PLIES]; // moves of the variant being searched, indexed by ply
+thread_local uint64_t key_history[MAX_GAME_PLIES]; // keys of the positions before each move, kept apart for the repetition test
+thread_local valid_move_count_entry valid_move_count_cache[VALID_MOVE_CACHE_SIZE];
+int  thread_count = 1;
+int  perft_depth = 0;
+long benchmark_passes = 0;
+int  retro_plies = 0; // plies searched backward from the final chessboard
+int  retro_depth = 0; // plies fully covered by retro_distance
+unordered_map<uint64_t, int> retro_distance; // positions that reach the final chessboard, with the fewest plies needed
+volatile long benchmark_sink = 0; // results of the timed calls, so that they are not optimized away
+int  split_ply = 0; // ply of the subtrees handed to the search threads (0 = no split)
+bool split_bound_search = false; // true while the threads search the subtrees a first time and share proven move counts
+game_state split_root; // position where the paths of the split tasks start, left untouched by the serial replay
+vector<split_task> split_tasks;
+size_t split_cursor = 0; // next subtree expected by the serial replay
+vector< deque<size_t> > thread_queue; // subtrees per search thread, idle threads steal from the back
+mutex split_mutex;
+condition_variable split_task_done;
+atomic<int> shared_min_move_count_mate(9999); // proven move counts, shared by the search threads
+atomic<int> shared_min_move_count_draw(9999);
+atomic<int> shared_min_move_count_chessboard(9999);
+thread_local string *thread_output = NULL; // set in search threads, which print into their subtree
+
+uint64_t king_attacks[NUM_SQUARES];
+uint64_t knight_attacks[NUM_SQUARES];
+uint64_t pawn_attacks[2][NUM_SQUARES];
+slider_magic bishop_magic[NUM_SQUARES];
+slider_magic rook_magic[NUM_SQUARES];
+uint64_t slider_attacks[102400 + 5248]; // sum of (1 << mask bits) over all squares for rooks and bishops
+uint64_t between_squares[NUM_SQUARES][NUM_SQUARES]; // squares strictly between two aligned squares
+uint64_t line_squares[NUM_SQUARES][NUM_SQUARES];	// whole line through two aligned squares
+int bitboard_index[128];
+int piece_distance[NUM_PIECE_TYPES][NUM_SQUARES][NUM_SQUARES]; // fewest moves on an empty chessboard, by white piece index
+uint64_t zobrist_piece[NUM_BITBOARDS][NUM_SQUARES];
+uint64_t zobrist_black_to_move;
+uint64_t zobrist_castling[4];
+uint64_t zobrist_en_passant[NUM_FILES];
+
+#define BITBOARD_INDEX(piece)	(bitboard_index[(int) (piece)])
+
+uint64_t const bishop_magic_numbers[NUM_SQUARES] = // found by trial with sparse xorshift64* random numbers, squares a8 to h1
+{
+	0x48081010008A2A80ULL, 0x000948110C0B2081ULL, 0x0944140400500000ULL, 0x4984104A00000101ULL,
+	0x4004030818283008ULL, 0x0206012462000121ULL, 0x1A02013008040001ULL, 0x0001008044200440ULL,
+	0x0000312208080880ULL, 0x0220021002009900ULL, 0x8080880801082000ULL, 0x000C11040080102AULL,
+	0x1402440421000210ULL, 0x0010120802080A81ULL, 0x0080084202104028ULL, 0x1100002082082082ULL,
+	0x0008403429080820ULL, 0x8104868204040412ULL, 0x6424084043060030ULL, 0x1108000420401000ULL,
+	0x9004101202020240ULL, 0x0032400608200412ULL, 0x0001009610822080ULL, 0x0008403429080820ULL,
+	0x0008068340104200ULL, 0x0010102858090121ULL, 0x81004C0018080313ULL, 0x4048080004820002ULL,
+	0x000900401C004049ULL, 0x0009420121C1101CULL, 0x4828504005040211ULL, 0x4828504005040211ULL,
+	0x0041041381202000ULL, 0x01008C1005601680ULL, 0x01D010900002040AULL, 0x4040020080080080ULL,
+	0x4801080200802200ULL, 0x4801080200802200ULL, 0x0010046108108080ULL, 0x90409090810A0220ULL,
+	0x8004020242201020ULL, 0x8004020242201020ULL, 0x0202010028020480ULL, 0x0000041144000801ULL,
+	0x00002000A4021080ULL, 0x0504090045040200ULL, 0x8182041102094400ULL, 0x0550008100480101ULL,
+	0xC002080404040400ULL, 0x0382004108292000ULL, 0x12000100A8040020ULL, 0xA005020442088020ULL,
+	0x2000001102020300ULL, 0x000021E0420C8808ULL, 0x3060200484888400ULL, 0x01280101021A0802ULL,
+	0x1030820110010500ULL, 0x0080012608025800ULL, 0x0002810084008800ULL, 0x800080000C208800ULL,
+	0xA408002140028204ULL, 0x0010006020322084ULL, 0x0210401044110050ULL, 0x40106000A1160020ULL
+};
+
+uint64_t const rook_magic_numbers[NUM_SQUARES] =
+{
+	0x0480046281400010ULL, 0x80C0200010004000ULL, 0x8780200008300180ULL, 0x8880060800100080ULL,
+	0x2100030010080084ULL, 0x0100040001000802ULL, 0x0200040800810200ULL, 0x0580008002407100ULL,
+	0x1000800080400020ULL, 0x0080401000402001ULL, 0x800C802002100880ULL, 0x800A002200884010ULL,
+	0x2046002008108600ULL, 0x0222009002000804ULL, 0x100B000421001200ULL, 0x0240800100004080ULL,
+	0x4540008020408006ULL, 0x8010054020084002ULL, 0x7D10010100200040ULL, 0x1408008010000882ULL,
+	0x4408010005000810ULL, 0x001E008004000280ULL, 0x0230040001080210ULL, 0x0000020004004081ULL,
+	0x0100400080208001ULL, 0x1000842300400100ULL, 0x1060100080200082ULL, 0x3219004B00100020ULL,
+	0x9010080080800400ULL, 0x8440020080800400ULL, 0x6008010080800200ULL, 0x4123008200010044ULL,
+	0x0280002001400240ULL, 0x0220100040400020ULL, 0x0060801003802008ULL, 0x0008100080800800ULL,
+	0x0105000801001004ULL, 0x100B000803000400ULL, 0x0000024814001021ULL, 0x00408000C2802100ULL,
+	0x4C40004020808002ULL, 0x4410500420024000ULL, 0x00C0100020008080ULL, 0x0000100008008080ULL,
+	0x8002000804220011ULL, 0x0802000804010100ULL, 0x0243100201040008ULL, 0x0000009100420014ULL,
+	0x1000400280022480ULL, 0x0020200040100040ULL, 0x00A000100800C140ULL, 0x0410001408008080ULL,
+	0x0000080004008080ULL, 0x0100020004008080ULL, 0x0303000200040300ULL, 0x1480006104008200ULL,
+	0x00008002204A1101ULL, 0x1040090010224081ULL, 0x4300C0200011000DULL, 0x8002041001002009ULL,
+	0x2005000800020411ULL, 0x110A008408100102ULL, 0x0006000108008402ULL, 0x0200002900884402ULL
+};
+
+int const king_steps[8][2]   = {{ 0, 1}, { 1, 1}, { 1, 0}, { 1,-1}, { 0,-1}, {-1,-1}, {-1, 0}, {-1, 1}}; // {file_step, rank_step}
+int const knight_steps[8][2] = {{ 1, 2}, {-1, 2}, { 2, 1}, { 2,-1}, { 1,-2}, {-1,-2}, {-2, 1}, {-2,-1}};
+int const bishop_steps[4][2] = {{ 1, 1}, { 1,-1}, {-1,-1}, {-1, 1}};
+int const rook_steps[4][2]   = {{ 0, 1}, { 1, 0}, { 0,-1}, {-1, 0}};
+int const white_pawn_capture_steps[2][2] = {{ 1, 1}, {-1, 1}};
+int const black_pawn_capture_steps[2][2] = {{ 1,-1}, {-1,-1}};
+
+perft_position const perft_positions[] = // https://www.chessprogramming.org/Perft_Results
+{
+	{"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+		{20, 400, 8902, 197281, 4865609, 119060324, 3195901860L}},
+	{"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+		{48, 2039, 97862, 4085603, 193690690, 8031647685L, 0}},
+	{"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+		{14, 191, 2812, 43238, 674624, 11030083, 178633661}},
+	{"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+		{6, 264, 9467, 422333, 15833292, 706045033, 0}},
+	{"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+		{44, 1486, 62379, 2103487, 89941194, 0, 0}},
+	{"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+		{46, 2079, 89890, 3894594, 164075551, 6923051137L, 0}}
+};
+
+char const *const benchmark_positions[] = // perft positions and the Kuwait goal
+{
+	"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+	"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+	"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+	"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+	"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+	"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+	"k7/P7/P7/P7/P7/P7/P7/R3K3 w Q - 0 35"
+};
 
 #define NORMAL				"\e[0m"
 #define REVERSE				"\e[7m"
@@ -68,20 +223,260 @@ int verbose = 1;
 #define BG_WHITE			"\e[47m"
 
 
+char const *rule_directions[NUM_RULE_DIRECTIONS] = {"up", "down", "left", "right", "up-left", "up-right", "down-left", "down-right"};
+int const rule_direction_steps[NUM_RULE_DIRECTIONS][2] = {{0, 1}, {0, -1}, {-1, 0}, {1, 0}, {-1, 1}, {1, 1}, {-1, -1}, {1, -1}}; // file, rank
+
+
+void
+init_rules(problem_rules *rules)
+{
+	// No piece frozen, every move and capture allowed
+	memset(rules->frozen, 0, sizeof(rules->frozen));
+	for (int piece = 0; piece < NUM_BITBOARDS; piece++)
+		for (int square = 0; square < NUM_SQUARES; square++)
+			rules->move_targets[piece][square] = rules->capture_targets[piece][square] = ~0ULL;
+}
+
+
 bool
-no_restriction(char piece, int square)
+get_rule_squares(char const *text, uint64_t *squares)
 {
-	return false;
+	// A square (a1), a file or range of files (a, b-f), or a rank or range of ranks (1, 2-7)
+	size_t length = strlen(text);
+	char first = text[0], last = (length == 3 && text[1] == '-') ? text[2] : text[0];
+	bool files = (first >= 'a' && first <= 'h' && last >= first && last <= 'h');
+	bool ranks = (first >= '1' && first <= '8' && last >= first && last <= '8');
+
+	if (length == 2 && first >= 'a' && first <= 'h' && text[1] >= '1' && text[1] <= '8')
+		*squares = BIT(SQUARE(first, text[1]));
+	else if ((length == 1 || (length == 3 && text[1] == '-')) && (files || ranks))
+	{
+		*squares = 0;
+		for (int square = 0; square < NUM_SQUARES; square++)
+			if ((files && FILE(square) >= first && FILE(square) <= last) || (ranks && RANK(square) >= first && RANK(square) <= last))
+				*squares |= BIT(square);
+	}
+	else
+		return false;
+
+	return true;
 }
 
+
 bool
-no_restriction(piece_move *move)
+get_rule_directions(char const *text, int from_square, uint64_t *targets)
 {
-	return false;
+	// Comma separated directions, by the signs of the file and rank steps as seen from the white side
+	*targets = 0;
+
+	while (*text)
+	{
+		size_t length = strcspn(text, ",");
+		int direction = 0;
+		while (direction < NUM_RULE_DIRECTIONS &&
+			   (strlen(rule_directions[direction]) != length || strncmp(text, rule_directions[direction], length) != 0))
+			direction++;
+		if (direction == NUM_RULE_DIRECTIONS)
+			return false;
+
+		for (int square = 0; square < NUM_SQUARES; square++)
+		{
+			int file_step = (FILE(square) > FILE(from_square)) - (FILE(square) < FILE(from_square));
+			int rank_step = (RANK(square) > RANK(from_square)) - (RANK(square) < RANK(from_square));
+			if (file_step == rule_direction_steps[direction][0] && rank_step == rule_direction_steps[direction][1])
+				*targets |= BIT(square);
+		}
+
+		text += length + (text[length] == ',');
+	}
+
+	return true;
+}
+
+
+bool
+compile_rule(problem_rules *rules, char *line)
+{
+	// <rule> <pieces> [<squares>] [<directions>], e.g. "frozen R a1", "no_capture NBRQK" or "moves P a-f up-left"
+	char *comment = strchr(line, '#');
+	if (comment)
+		*comment = 0;
+
+	char *rule = strtok(line, " \t\r");
+	if (rule == NULL)
+		return true; // empty line
+
+	char *pieces = strtok(NULL, " \t\r");
+	if (pieces == NULL || strspn(pieces, ALL_PIECES) != strlen(pieces))
+		return false;
+
+	uint64_t squares = ~0ULL;
+	char *token = strtok(NULL, " \t\r");
+	if (token && get_rule_squares(token, &squares))
+		token = strtok(NULL, " \t\r");
+
+	char *directions = NULL;
+	if (strcmp(rule, "moves") == 0)
+	{
+		directions = token;
+		token = strtok(NULL, " \t\r");
+		if (directions == NULL)
+			return false;
+	}
+	else if (strcmp(rule, "frozen") != 0 && strcmp(rule, "no_capture") != 0)
+		return false;
+
+	if (token)
+		return false;
+
+	for (char *piece = pieces; *piece; piece++)
+	{
+		int index = BITBOARD_INDEX(*piece);
+
+		if (strcmp(rule, "frozen") == 0)
+			rules->frozen[index] |= squares;
+
+		for (int square = 0; square < NUM_SQUARES; square++)
+		{
+			uint64_t targets;
+
+			if (!(squares & BIT(square)))
+				continue;
+
+			if (strcmp(rule, "no_capture") == 0)
+				rules->capture_targets[index][square] = 0;
+
+			if (directions)
+			{
+				if (!get_rule_directions(directions, square, &targets))
+					return false;
+				rules->move_targets[index][square] &= targets;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+int
+compile_rules(problem_rules *rules, char const *rules_text)
+{
+	// Returns 0, or the number of the first invalid line
+	char line[MAX_RULE_LINE];
+	int line_number = 0;
+
+	init_rules(rules);
+	while (*rules_text)
+	{
+		size_t length = strcspn(rules_text, "\n");
+		line_number++;
+		if (length >= sizeof(line))
+			return line_number;
+
+		memcpy(line, rules_text, length);
+		line[length] = 0;
+		if (!compile_rule(rules, line))
+			return line_number;
+
+		rules_text += length + (rules_text[length] == '\n');
+	}
+
+	problem_restrictions = true;
+	return 0;
+}
+
+
+int
+read_rules_file(char const *file_name)
+{
+	// Returns 0, the number of the first invalid line, or -1 if the file cannot be read
+	FILE *file = fopen(file_name, "r");
+	if (!file)
+		return -1;
+
+	string rules_text;
+	char buffer[4096];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		rules_text.append(buffer, length);
+	fclose(file);
+
+	return compile_rules(&rules, rules_text.c_str());
 }
 
-bool (*special_piece_restriction)(char piece, int square) = no_restriction;
-bool (*special_move_restriction)(piece_move *move) = no_restriction;
+
+// Policies of the problem restrictions: none, or the masks of the problem rules, applied while the moves are generated
+
+struct no_restrictions
+{
+	static uint64_t
+	movable(game_state *game, int color)
+	{
+		return game->color_bitboard[color];
+	}
+
+	static uint64_t
+	targets(game_state *, char, int)
+	{
+		return ~0ULL;
+	}
+
+	static bool
+	piece(char, int)
+	{
+		return false;
+	}
+
+	static bool
+	move(piece_move *)
+	{
+		return false;
+	}
+};
+
+struct rule_restrictions
+{
+	static uint64_t
+	movable(game_state *game, int color)
+	{
+		// Frozen pieces are never expanded
+		uint64_t frozen = 0;
+		for (int index = color * NUM_PIECE_TYPES; index < (color + 1) * NUM_PIECE_TYPES; index++)
+			frozen |= game->piece_bitboard[index] & rules.frozen[index];
+
+		return game->color_bitboard[color] & ~frozen;
+	}
+
+	static uint64_t
+	targets(game_state *game, char moving_piece, int square)
+	{
+		// Empty squares, but the en passant target of a pawn, are reached without a capture
+		int index = BITBOARD_INDEX(moving_piece);
+		uint64_t empty = ~game->occupied_bitboard;
+		if (IS_PAWN(moving_piece) && game->en_passant_target_square != NO_SQUARE)
+			empty &= ~BIT(game->en_passant_target_square);
+
+		return rules.move_targets[index][square] & (rules.capture_targets[index][square] | empty);
+	}
+
+	static bool
+	piece(char moving_piece, int square)
+	{
+		return (rules.frozen[BITBOARD_INDEX(moving_piece)] & BIT(square)) != 0;
+	}
+
+	static bool
+	move(piece_move *valid_move)
+	{
+		int index = BITBOARD_INDEX(valid_move->moving_piece);
+		uint64_t targets = rules.move_targets[index][valid_move->from_square];
+		if (valid_move->capture)
+			targets &= rules.capture_targets[index][valid_move->from_square];
+
+		return !(targets & BIT(valid_move->to_square));
+	}
+};
 
 
 int
@@ -265,6 +660,58 @@ print_chessboard(char *chessboard)
 }
 
 
+void *
+allocate_memory(size_t size, size_t alignment)
+{
+	// The replaced forms of operator new count their allocations here, see heap_allocations
+	heap_allocations++;
+
+	// posix_memalign serves both alignments, and its memory is released by free in operator delete
+	void *memory;
+	if (posix_memalign(&memory, max(alignment, alignof(max_align_t)), size ? size : 1))
+		throw bad_alloc();
+
+	return memory;
+}
+
+
+void *
+operator new(size_t size)
+{
+	// The array, nothrow and aligned sized forms of new and delete forward to the forms replaced here
+	return allocate_memory(size, 0);
+}
+
+
+void *
+operator new(size_t size, align_val_t alignment)
+{
+	return allocate_memory(size, (size_t) alignment);
+}
+
+
+void
+operator delete(void *memory) noexcept
+{
+	free(memory);
+}
+
+
+void
+operator delete(void *memory, size_t) noexcept
+{
+	// Replaced with the plain form, as -Wsized-deallocation asks
+	free(memory);
+}
+
+
+void
+operator delete(void *memory, align_val_t) noexcept
+{
+	free(memory);
+}
+
+
 void
 default_move(piece_move *move, char piece, int square)
 {
@@ -283,435 +730,812 @@ default_move(piece_move *move, char piece, int square)
 }
 
 
-void
-get_moves(piece_move *moves, int *index, char *chessboard, char file, char rank, int file_step, int rank_step, int max_steps)
+uint64_t
+ray_attacks(int square, uint64_t occupied, int const (*steps)[2], int num_directions, int max_steps)
 {
-	int color = COLOR(chessboard[SQUARE(file, rank)]);
-	int f = file + file_step;
-	int r = rank + rank_step;
+	// Slow ray walk, used only to fill the attack tables
+	uint64_t attacks = 0;
 
-	for (int step = 0; step < max_steps; step++)
+	for (int direction = 0; direction < num_directions; direction++)
 	{
-		if (f < 'a' || f > ('a' + NUM_FILES - 1) || r < '1' || r > ('1' + NUM_RANKS - 1))
-			break;
-
-		int square = SQUARE(f, r);
+		int f = (square % NUM_FILES) + steps[direction][0];
+		int r = (square / NUM_FILES) - steps[direction][1]; // rows are numbered top-down
 
-		if (chessboard[square] != EMPTY)
+		for (int step = 0; step < max_steps; step++)
 		{
-			if (COLOR(chessboard[square]) != color)
-			{
-				moves[*index].to_square = square;
-				moves[*index].capture = true;
-				(*index)++;
-			}
-			break;
-		}
+			if (f < 0 || f >= NUM_FILES || r < 0 || r >= NUM_RANKS)
+				break;
 
-		moves[*index].to_square = square;
-		(*index)++;
-		f += file_step;
-		r += rank_step;
+			attacks |= BIT(r * NUM_FILES + f);
+			if (occupied & BIT(r * NUM_FILES + f))
+				break;
+
+			f += steps[direction][0];
+			r -= steps[direction][1];
+		}
 	}
+
+	return attacks;
 }
 
 
-void
-get_castling(piece_move *moves, int *index, char *chessboard, int color, char castling_side, bool castling_ability)
+int
+slider_attacks_index(slider_magic *magic, uint64_t occupied)
 {
-	if (!castling_ability)
-		return;
-
-	char file = 'e';
-	char rank = (color == WHITE) ? '1' : ('1' + NUM_RANKS - 1);
-	int first_empty_square = IS_KING(castling_side) ? SQUARE(file + 1, rank) : SQUARE(file - 3, rank);
-	int last_empty_square  = IS_KING(castling_side) ? SQUARE(file + 2, rank) : SQUARE(file - 1, rank);
-
-	for (int square = first_empty_square; square <= last_empty_square; square++)
-		if (chessboard[square] != EMPTY)
-			return;
-
-	moves[*index].to_square = IS_KING(castling_side) ? SQUARE(file + 2, rank) : SQUARE(file - 2, rank);
-	(*index)++;
+#ifdef __BMI2__
+	return _pext_u64(occupied, magic->mask);
+#else
+	return ((occupied & magic->mask) * magic->magic) >> magic->shift;
+#endif
 }
 
 
 void
-get_move_pawn_forward(piece_move *moves, int index_base, int *index, char *chessboard, char file, char rank, int step = 1)
+init_slider_magic(slider_magic *magic, int square, int const (*steps)[2], uint64_t magic_number, uint64_t **free_attacks)
 {
-	int color = COLOR(chessboard[SQUARE(file, rank)]);
-	int rank_step = (color == WHITE) ? step : -step;
-	char initial_rank = (color == WHITE) ? ('1' + 1) : ('1' + NUM_RANKS - 2);
-	char r = rank + rank_step;
-
-	int square = SQUARE(file, r);
-	if (chessboard[square] == EMPTY)
+	// https://www.chessprogramming.org/Magic_Bitboards (fancy magic bitboards, or PEXT bitboards if BMI2 is available)
+	int row = square / NUM_FILES, column = square % NUM_FILES;
+	uint64_t edges = ((RANK_8_BITBOARD | RANK_1_BITBOARD) & ~(RANK_8_BITBOARD << (row * NUM_FILES))) |
+					 ((FILE_A_BITBOARD | FILE_H_BITBOARD) & ~(FILE_A_BITBOARD << column));
+
+	magic->mask = ray_attacks(square, 0, steps, 4, NUM_FILES - 1) & ~edges;
+	magic->magic = magic_number;
+	magic->shift = 64 - POPCOUNT(magic->mask);
+	magic->attacks = *free_attacks;
+	*free_attacks += (1 << POPCOUNT(magic->mask));
+
+	uint64_t subset = 0;
+	do	// Carry-Rippler enumeration of all subsets of the mask
 	{
-		moves[index_base + (*index)].to_square = square;
-		(*index)++;
-
-		if (rank == initial_rank && step == 1)
-			get_move_pawn_forward(moves, index_base, index, chessboard, file, rank, 2);
-	}
+		magic->attacks[slider_attacks_index(magic, subset)] = ray_attacks(square, subset, steps, 4, NUM_FILES - 1);
+		subset = (subset - magic->mask) & magic->mask;
+	} while (subset);
 }
 
 
 void
-get_move_pawn_capture(piece_move *moves, int index_base, int *index, char *chessboard, char file, char rank, int file_step, int en_passant_target_square)
+init_attack_tables()
 {
-	int color = COLOR(chessboard[SQUARE(file, rank)]);
-	int rank_step = (color == WHITE) ? 1 : -1;
-	char f = file + file_step;
-	char r = rank + rank_step;
-	if (f < 'a' || f > ('a' + NUM_FILES - 1))
-		return;
+	uint64_t *free_attacks = slider_attacks;
 
-	int square = SQUARE(f, r);
-	if ((chessboard[square] != EMPTY && COLOR(chessboard[square]) != color) || (square == en_passant_target_square))
+	for (int i = 0; i < NUM_BITBOARDS; i++)
+		bitboard_index[(int) ALL_PIECES[i]] = i;
+
+	for (int square = 0; square < NUM_SQUARES; square++)
 	{
-		moves[index_base + (*index)].to_square = square;
-		moves[index_base + (*index)].capture = true;
-		moves[index_base + (*index)].en_passant = (square == en_passant_target_square);
-		(*index)++;
+		king_attacks[square]   = ray_attacks(square, 0, king_steps, 8, 1);
+		knight_attacks[square] = ray_attacks(square, 0, knight_steps, 8, 1);
+		pawn_attacks[WHITE][square] = ray_attacks(square, 0, white_pawn_capture_steps, 2, 1);
+		pawn_attacks[BLACK][square] = ray_attacks(square, 0, black_pawn_capture_steps, 2, 1);
+		init_slider_magic(&bishop_magic[square], square, bishop_steps, bishop_magic_numbers[square], &free_attacks);
+		init_slider_magic(&rook_magic[square],   square, rook_steps,   rook_magic_numbers[square],   &free_attacks);
+	}
+
+	for (int from = 0; from < NUM_SQUARES; from++)
+	{
+		for (int to = 0; to < NUM_SQUARES; to++)
+		{
+			between_squares[from][to] = line_squares[from][to] = 0;
+
+			for (int slider = 0; slider < 2; slider++)
+			{
+				int const (*steps)[2] = (slider == 0) ? bishop_steps : rook_steps;
+
+				if (from != to && (ray_attacks(from, 0, steps, 4, NUM_FILES - 1) & BIT(to)))
+				{
+					between_squares[from][to] = ray_attacks(from, BIT(to), steps, 4, NUM_FILES - 1) &
+												ray_attacks(to, BIT(from), steps, 4, NUM_FILES - 1);
+					line_squares[from][to] = (ray_attacks(from, 0, steps, 4, NUM_FILES - 1) &
+											  ray_attacks(to,   0, steps, 4, NUM_FILES - 1)) | BIT(from) | BIT(to);
+				}
+			}
+		}
 	}
+
 }
 
 
-int
-get_legal_moves(piece_move *legal_moves, game_state *game, char piece, int square)
+uint64_t
+slider_attacks_lookup(slider_magic *magic, uint64_t occupied)
 {
-	char file = FILE(square);
-	char rank = RANK(square);
-	char *cb = game->chessboard;
-	int color = COLOR(cb[square]);
-	bool castling_short_ability, castling_long_ability;
+	uint64_t attacks = magic->attacks[slider_attacks_index(magic, occupied)];
 
-	for (int i = 0; i < MAX_LEGAL_MOVES; i++)
-		default_move(&legal_moves[i], piece, square);
+	return attacks;
+}
 
-	int i = 0, j = 0;
+
+uint64_t
+piece_attacks(char piece, int square, uint64_t occupied)
+{
 	switch (piece)
 	{
 		case WHITE_KING:   case BLACK_KING:
-			get_moves(legal_moves, &i, cb, file, rank,  0,  1, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1,  1, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1,  0, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1, -1, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  0, -1, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1, -1, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  0, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  1, 1);
-
-			castling_short_ability = (color == WHITE && game->white_castling_short_ability) || (color == BLACK && game->black_castling_short_ability);
-			castling_long_ability  = (color == WHITE && game->white_castling_long_ability)  || (color == BLACK && game->black_castling_long_ability);
-			get_castling(legal_moves, &i, cb, color, 'K', castling_short_ability);
-			get_castling(legal_moves, &i, cb, color, 'Q', castling_long_ability);
-			break;
+			return king_attacks[square];
 
 		case WHITE_QUEEN:  case BLACK_QUEEN:
-			get_moves(legal_moves, &i, cb, file, rank,  0,  1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1,  1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1,  0, NUM_FILES - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1, -1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  0, -1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1, -1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  0, NUM_FILES - 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  1, NUM_RANKS - 1);
-			break;
+			return slider_attacks_lookup(&rook_magic[square], occupied) | slider_attacks_lookup(&bishop_magic[square], occupied);
 
 		case WHITE_ROOK:   case BLACK_ROOK:
-			get_moves(legal_moves, &i, cb, file, rank,  0,  1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1,  0, NUM_FILES - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  0, -1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  0, NUM_FILES - 1);
-			break;
+			return slider_attacks_lookup(&rook_magic[square], occupied);
 
 		case WHITE_BISHOP: case BLACK_BISHOP:
-			get_moves(legal_moves, &i, cb, file, rank,  1,  1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1, -1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1, -1, NUM_RANKS - 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  1, NUM_RANKS - 1);
-			break;
+			return slider_attacks_lookup(&bishop_magic[square], occupied);
 
 		case WHITE_KNIGHT: case BLACK_KNIGHT:
-			get_moves(legal_moves, &i, cb, file, rank,  1,  2, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1,  2, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  2,  1, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  2, -1, 1);
-			get_moves(legal_moves, &i, cb, file, rank,  1, -2, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -1, -2, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -2,  1, 1);
-			get_moves(legal_moves, &i, cb, file, rank, -2, -1, 1);
-			break;
+			return knight_attacks[square];
 
-		case WHITE_PAWN:   case BLACK_PAWN:
-			get_move_pawn_forward(legal_moves, i, &j, cb, file, rank);
-			get_move_pawn_capture(legal_moves, i, &j, cb, file, rank,  1, game->en_passant_target_square);
-			get_move_pawn_capture(legal_moves, i, &j, cb, file, rank, -1, game->en_passant_target_square);
+		case WHITE_PAWN:
+			return pawn_attacks[WHITE][square];
+
+		case BLACK_PAWN:
+			return pawn_attacks[BLACK][square];
+	}
+
+	return 0;
+}
+
+
+void
+init_piece_distances()
+{
+	for (int i = 1; i < NUM_PIECE_TYPES; i++) // knights to kings, pawns have their own distance
+	{
+		for (int from = 0; from < NUM_SQUARES; from++)
+		{
+			int *distance = piece_distance[i][from];
+			uint64_t reached = BIT(from), frontier = BIT(from);
 
-			if ((color == WHITE && rank == ('1' + NUM_RANKS - 2)) || (color == BLACK && rank == '2')) // pawn promotion
+			for (int to = 0; to < NUM_SQUARES; to++)
+				distance[to] = NO_DISTANCE;
+			distance[from] = 0;
+
+			for (int moves = 1; frontier; moves++) // breadth first over the empty chessboard
 			{
-				for (int k = 0; k < j; k++)
+				uint64_t next_frontier = 0;
+				while (frontier)
 				{
-					legal_moves[i + k +   j] = legal_moves[i + k];
-					legal_moves[i + k + 2*j] = legal_moves[i + k];
-					legal_moves[i + k + 3*j] = legal_moves[i + k];
-					legal_moves[i + k      ].promoted_piece = (color == WHITE) ? WHITE_QUEEN  : BLACK_QUEEN;
-					legal_moves[i + k +   j].promoted_piece = (color == WHITE) ? WHITE_ROOK   : BLACK_ROOK;
-					legal_moves[i + k + 2*j].promoted_piece = (color == WHITE) ? WHITE_BISHOP : BLACK_BISHOP;
-					legal_moves[i + k + 3*j].promoted_piece = (color == WHITE) ? WHITE_KNIGHT : BLACK_KNIGHT;
+					next_frontier |= piece_attacks(WHITE_PIECES[i], LSB(frontier), 0) & ~reached;
+					frontier &= frontier - 1;
 				}
-				j *= 4;
+				reached |= next_frontier;
+				frontier = next_frontier;
+
+				for (uint64_t squares = next_frontier; squares; squares &= squares - 1)
+					distance[LSB(squares)] = moves;
 			}
-			i += j;
-			break;
+		}
 	}
+}
 
-	return i;
+
+uint64_t
+attackers_to(game_state *game, int square, uint64_t occupied)
+{
+	// All pieces of both colors attacking the square, found by looking outward from it
+	uint64_t *bitboard = game->piece_bitboard;
+	uint64_t rooks_queens   = bitboard[BITBOARD_INDEX(WHITE_ROOK)]   | bitboard[BITBOARD_INDEX(BLACK_ROOK)] |
+							  bitboard[BITBOARD_INDEX(WHITE_QUEEN)]  | bitboard[BITBOARD_INDEX(BLACK_QUEEN)];
+	uint64_t bishops_queens = bitboard[BITBOARD_INDEX(WHITE_BISHOP)] | bitboard[BITBOARD_INDEX(BLACK_BISHOP)] |
+							  bitboard[BITBOARD_INDEX(WHITE_QUEEN)]  | bitboard[BITBOARD_INDEX(BLACK_QUEEN)];
+
+	uint64_t attackers = (pawn_attacks[WHITE][square] & bitboard[BITBOARD_INDEX(BLACK_PAWN)]) |
+						 (pawn_attacks[BLACK][square] & bitboard[BITBOARD_INDEX(WHITE_PAWN)]) |
+						 (knight_attacks[square] & (bitboard[BITBOARD_INDEX(WHITE_KNIGHT)] | bitboard[BITBOARD_INDEX(BLACK_KNIGHT)])) |
+						 (king_attacks[square]   & (bitboard[BITBOARD_INDEX(WHITE_KING)]   | bitboard[BITBOARD_INDEX(BLACK_KING)])) |
+						 (slider_attacks_lookup(&rook_magic[square],   occupied) & rooks_queens) |
+						 (slider_attacks_lookup(&bishop_magic[square], occupied) & bishops_queens);
+
+	return attackers;
 }
 
 
-void
-update_chessboard(char *chessboard, char *previous_chessboard, piece_move *move)
+uint64_t
+attacked_squares(game_state *game, int color, uint64_t occupied)
 {
-	memcpy(chessboard, previous_chessboard, NUM_SQUARES);
+	uint64_t pawns = game->piece_bitboard[BITBOARD_INDEX((color == WHITE) ? WHITE_PAWN : BLACK_PAWN)];
+	uint64_t pieces = game->color_bitboard[color] & ~pawns;
+	uint64_t attacks;
 
-	chessboard[move->from_square] = EMPTY;
-	chessboard[move->to_square] = move->moving_piece;
+	if (color == WHITE) // pawns attack all at once; row 0 is rank 8
+		attacks = ((pawns >> (NUM_FILES + 1)) & ~FILE_H_BITBOARD) | ((pawns >> (NUM_FILES - 1)) & ~FILE_A_BITBOARD);
+	else
+		attacks = ((pawns << (NUM_FILES - 1)) & ~FILE_H_BITBOARD) | ((pawns << (NUM_FILES + 1)) & ~FILE_A_BITBOARD);
 
-	if (IS_KING(move->moving_piece) && FILE(move->from_square) == 'e') // Castling
+	while (pieces)
 	{
-		if (move->to_square == SQUARE('g','1'))
-		{
-			chessboard[SQUARE('h','1')] = EMPTY;
-			chessboard[SQUARE('f','1')] = WHITE_ROOK;
-		}
-		else if (move->to_square == SQUARE('c','1'))
-		{
-			chessboard[SQUARE('a','1')] = EMPTY;
-			chessboard[SQUARE('d','1')] = WHITE_ROOK;
-		}
-		else if (move->to_square == SQUARE('g','8'))
-		{
-			chessboard[SQUARE('h','8')] = EMPTY;
-			chessboard[SQUARE('f','8')] = BLACK_ROOK;
-		}
-		else if (move->to_square == SQUARE('c','8'))
-		{
-			chessboard[SQUARE('a','8')] = EMPTY;
-			chessboard[SQUARE('d','8')] = BLACK_ROOK;
-		}
+		int square = LSB(pieces);
+		pieces &= pieces - 1;
+		attacks |= piece_attacks(game->chessboard[square], square, occupied);
 	}
 
-	if (move->en_passant)
-		chessboard[SQUARE(FILE(move->to_square), RANK(move->from_square))] = EMPTY;
-
-	if (IS_PIECE(move->promoted_piece))
-		chessboard[move->to_square] = move->promoted_piece;
+	return attacks;
 }
 
 
 void
-update_state(game_state *game)
+get_king_safety(game_state *game, king_safety *safety)
 {
-	game->white_castling_short_ability  =
-	game->white_castling_long_ability  &= (game->chessboard[SQUARE('e','1')] == WHITE_KING);
-	game->white_castling_short_ability &= (game->chessboard[SQUARE('h','1')] == WHITE_ROOK);
-	game->white_castling_long_ability  &= (game->chessboard[SQUARE('a','1')] == WHITE_ROOK);
-	game->black_castling_short_ability  =
-	game->black_castling_long_ability  &= (game->chessboard[SQUARE('e', ('1' + NUM_RANKS - 1))] == BLACK_KING);
-	game->black_castling_short_ability &= (game->chessboard[SQUARE('h', ('1' + NUM_RANKS - 1))] == BLACK_ROOK);
-	game->black_castling_long_ability  &= (game->chessboard[SQUARE('a', ('1' + NUM_RANKS - 1))] == BLACK_ROOK);
-
-	if (game->last_move)
+	int color = game->side_to_move;
+	uint64_t own = game->color_bitboard[color];
+	uint64_t enemy = game->color_bitboard[!color];
+	uint64_t *bitboard = game->piece_bitboard;
+	char const *pieces = (color == WHITE) ? BLACK_PIECES : WHITE_PIECES; // enemy pieces in PNBRQK order
+
+	safety->king_square = LSB(bitboard[BITBOARD_INDEX((color == WHITE) ? WHITE_KING : BLACK_KING)]);
+	safety->checkers = attackers_to(game, safety->king_square, game->occupied_bitboard) & enemy;
+	safety->enemy_attacks = attacked_squares(game, !color, game->occupied_bitboard ^ BIT(safety->king_square));
+
+	if (safety->checkers == 0)
+		safety->check_mask = ~0ULL;
+	else if ((safety->checkers & (safety->checkers - 1)) == 0)
+		safety->check_mask = safety->checkers | between_squares[safety->king_square][LSB(safety->checkers)];
+	else
+		safety->check_mask = 0; // double check: only the king can move
+
+	safety->pinned = 0;
+	uint64_t snipers = (slider_attacks_lookup(&rook_magic[safety->king_square], 0) &
+						(bitboard[BITBOARD_INDEX(pieces[3])] | bitboard[BITBOARD_INDEX(pieces[4])])) |
+					   (slider_attacks_lookup(&bishop_magic[safety->king_square], 0) &
+						(bitboard[BITBOARD_INDEX(pieces[2])] | bitboard[BITBOARD_INDEX(pieces[4])]));
+	while (snipers)
 	{
-		game->en_passant_target_square = NO_SQUARE;
-		if (IS_PAWN(game->last_move->moving_piece))
-			if (RANK(game->last_move->from_square) == '2' && RANK(game->last_move->to_square) == '4')
-				game->en_passant_target_square = SQUARE(FILE(game->last_move->from_square), '3');
-			else if (RANK(game->last_move->from_square) == ('1' + NUM_RANKS - 2) && RANK(game->last_move->to_square) == ('1' + NUM_RANKS - 4))
-				game->en_passant_target_square = SQUARE(FILE(game->last_move->from_square), ('1' + NUM_RANKS - 3));
+		int square = LSB(snipers);
+		snipers &= snipers - 1;
 
-		game->half_move_clock++;
-		if (IS_PAWN(game->last_move->moving_piece) || game->last_move->capture)
-			game->half_move_clock = 0;
+		uint64_t blockers = between_squares[safety->king_square][square] & game->occupied_bitboard;
+		if (blockers && (blockers & (blockers - 1)) == 0 && (blockers & own))
+			safety->pinned |= blockers;
 	}
 }
 
 
 void
-set_game_state(game_state *game, char *chessboard = initial_chessboard, int side_to_move = WHITE, int full_move_counter = 1)
+get_moves(piece_move *moves, int *index, game_state *game, uint64_t targets)
 {
-	memcpy(game->chessboard, chessboard, NUM_SQUARES);
-	game->last_move = NULL;
-	game->side_to_move = side_to_move;
-	game->white_castling_short_ability = true;
-	game->white_castling_long_ability  = true;
-	game->black_castling_short_ability = true;
-	game->black_castling_long_ability  = true;
-	game->en_passant_target_square = NO_SQUARE;
-	game->half_move_clock = 0;
-	game->full_move_counter = full_move_counter;
-	game->previous = NULL;
+	while (targets)
+	{
+		int square = LSB(targets);
+		targets &= targets - 1;
 
-	update_state(game);
+		moves[*index].to_square = square;
+		moves[*index].capture = !IS_EMPTY(game->chessboard[square]);
+		(*index)++;
+	}
 }
 
 
 bool
-can_reach(char *chessboard, char from_file, char from_rank, int to_square, int file_step, int rank_step, int max_steps)
+castling_under_attack(king_safety *safety, int king_square, char castling_side)
 {
-	int f = from_file + file_step;
-	int r = from_rank + rank_step;
+	// The king cannot castle out of, through or into check
+	int file_step = IS_KING(castling_side) ? 1 : -1;
+	uint64_t king_path = BIT(king_square) | BIT(king_square + file_step) | BIT(king_square + 2 * file_step);
+	bool under_attack = (safety->enemy_attacks & king_path) != 0;
 
-	for (int step = 0; step < max_steps; step++)
-	{
-		if (f < 'a' || f > ('a' + NUM_FILES - 1) || r < '1' || r > ('1' + NUM_RANKS - 1))
-			break;
+	return under_attack;
+}
 
-		int square = SQUARE(f, r);
 
-		if (square == to_square)
-			return true;
+void
+get_castling(piece_move *moves, int *index, game_state *game, king_safety *safety, int color, char castling_side, bool castling_ability)
+{
+	if (!castling_ability)
+		return;
 
-		if (chessboard[square] != EMPTY)
-			break;
+	int king_square = (color == WHITE) ? SQUARE('e','1') : SQUARE('e', ('1' + NUM_RANKS - 1));
+	int rook_square = IS_KING(castling_side) ? (king_square + 3) : (king_square - 4);
+	char rook = (color == WHITE) ? WHITE_ROOK : BLACK_ROOK;
+	uint64_t empty_squares = IS_KING(castling_side) ? (BIT(king_square + 1) | BIT(king_square + 2)) :
+												      (BIT(king_square - 1) | BIT(king_square - 2) | BIT(king_square - 3));
+
+	if (!(game->piece_bitboard[BITBOARD_INDEX(rook)] & BIT(rook_square)) || (game->occupied_bitboard & empty_squares))
+		return;
+
+	if (castling_under_attack(safety, king_square, castling_side))
+		return;
+
+	moves[*index].to_square = IS_KING(castling_side) ? (king_square + 2) : (king_square - 2);
+	(*index)++;
+}
+
+
+void
+get_move_pawn_forward(piece_move *moves, int index_base, int *index, game_state *game, int square, uint64_t allowed)
+{
+	int color = COLOR(game->chessboard[square]);
+	int square_step = (color == WHITE) ? -NUM_FILES : NUM_FILES;
+	char initial_rank = (color == WHITE) ? ('1' + 1) : ('1' + NUM_RANKS - 2);
+
+	if (game->occupied_bitboard & BIT(square + square_step))
+		return;
 
-		f += file_step;
-		r += rank_step;
+	if (allowed & BIT(square + square_step))
+	{
+		moves[index_base + (*index)].to_square = square + square_step;
+		(*index)++;
 	}
 
-	return false;
+	if (RANK(square) == initial_rank && !(game->occupied_bitboard & BIT(square + 2 * square_step)) &&
+		(allowed & BIT(square + 2 * square_step)))
+	{
+		moves[index_base + (*index)].to_square = square + 2 * square_step;
+		(*index)++;
+	}
 }
 
 
 bool
-square_is_attacked_by_piece(char *chessboard, int from_square, int to_square, char piece)
+en_passant_is_legal(game_state *game, king_safety *safety, int square, int en_passant_target_square)
+{
+	// The captured pawn leaves its square too, which may expose the king along its rank
+	int color = COLOR(game->chessboard[square]);
+	int captured_square = SQUARE(FILE(en_passant_target_square), RANK(square));
+	char enemy_pawn = (color == WHITE) ? BLACK_PAWN : WHITE_PAWN;
+
+	if (game->chessboard[captured_square] != enemy_pawn)
+		return false;
+
+	uint64_t occupied = (game->occupied_bitboard ^ BIT(square) ^ BIT(captured_square)) | BIT(en_passant_target_square);
+	uint64_t attackers = attackers_to(game, safety->king_square, occupied) & game->color_bitboard[!color] & ~BIT(captured_square);
+
+	return (attackers == 0);
+}
+
+
+void
+get_move_pawn_capture(piece_move *moves, int index_base, int *index, game_state *game, king_safety *safety, int square,
+					  int en_passant_target_square, uint64_t allowed)
+{
+	int color = COLOR(game->chessboard[square]);
+	uint64_t targets = game->color_bitboard[!color] & allowed;
+	if (en_passant_target_square != NO_SQUARE && (pawn_attacks[color][square] & BIT(en_passant_target_square)) &&
+		en_passant_is_legal(game, safety, square, en_passant_target_square))
+		targets |= BIT(en_passant_target_square);
+	targets &= pawn_attacks[color][square];
+
+	while (targets)
+	{
+		int to_square = LSB(targets);
+		targets &= targets - 1;
+
+		moves[index_base + (*index)].to_square = to_square;
+		moves[index_base + (*index)].capture = true;
+		moves[index_base + (*index)].en_passant = (to_square == en_passant_target_square);
+		(*index)++;
+	}
+}
+
+
+int
+get_legal_moves(piece_move *legal_moves, game_state *game, king_safety *safety, char piece, int square, uint64_t rule_targets = ~0ULL)
 {
-	char file = FILE(from_square);
-	char rank = RANK(from_square);
-	int color = COLOR(chessboard[from_square]);
+	// The rule targets of a problem filter the moves as they are generated
+	int color = COLOR(piece);
+	bool castling_short_ability, castling_long_ability;
+	uint64_t targets = piece_attacks(piece, square, game->occupied_bitboard) & ~game->color_bitboard[color] & rule_targets;
+	uint64_t allowed = safety->check_mask;
+	int en_passant_target_square = game->en_passant_target_square;
+
+	if (safety->pinned & BIT(square))
+		allowed &= line_squares[safety->king_square][square];
 
+	piece_move move;
+	default_move(&move, piece, square);
+	for (int i = 0; i < MAX_LEGAL_MOVES; i++)
+		legal_moves[i] = move;
+
+	int i = 0, j = 0;
 	switch (piece)
 	{
 		case WHITE_KING:   case BLACK_KING:
-			if (can_reach(chessboard, file, rank, to_square,  0,  1, 1) ||
-			    can_reach(chessboard, file, rank, to_square,  1,  1, 1) ||
-				can_reach(chessboard, file, rank, to_square,  1,  0, 1) ||
-				can_reach(chessboard, file, rank, to_square,  1, -1, 1) ||
-				can_reach(chessboard, file, rank, to_square,  0, -1, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1, -1, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1,  0, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1,  1, 1))
-				return true;
+			get_moves(legal_moves, &i, game, targets & ~safety->enemy_attacks);
+
+			castling_short_ability = ((color == WHITE && game->white_castling_short_ability) || (color == BLACK && game->black_castling_short_ability)) &&
+									 (rule_targets & BIT(square + 2));
+			castling_long_ability  = ((color == WHITE && game->white_castling_long_ability)  || (color == BLACK && game->black_castling_long_ability)) &&
+									 (rule_targets & BIT(square - 2));
+			get_castling(legal_moves, &i, game, safety, color, 'K', castling_short_ability);
+			get_castling(legal_moves, &i, game, safety, color, 'Q', castling_long_ability);
 			break;
 
 		case WHITE_QUEEN:  case BLACK_QUEEN:
-			if (can_reach(chessboard, file, rank, to_square,  0,  1, 7) ||
-			    can_reach(chessboard, file, rank, to_square,  1,  1, 7) ||
-				can_reach(chessboard, file, rank, to_square,  1,  0, 7) ||
-				can_reach(chessboard, file, rank, to_square,  1, -1, 7) ||
-				can_reach(chessboard, file, rank, to_square,  0, -1, 7) ||
-				can_reach(chessboard, file, rank, to_square, -1, -1, 7) ||
-				can_reach(chessboard, file, rank, to_square, -1,  0, 7) ||
-				can_reach(chessboard, file, rank, to_square, -1,  1, 7))
-				return true;
-			break;
-
 		case WHITE_ROOK:   case BLACK_ROOK:
-			if (can_reach(chessboard, file, rank, to_square,  0,  1, 7) ||
-				can_reach(chessboard, file, rank, to_square,  1,  0, 7) ||
-				can_reach(chessboard, file, rank, to_square,  0, -1, 7) ||
-				can_reach(chessboard, file, rank, to_square, -1,  0, 7))
-				return true;
-			break;
-
 		case WHITE_BISHOP: case BLACK_BISHOP:
-			if (can_reach(chessboard, file, rank, to_square,  1,  1, 7) ||
-				can_reach(chessboard, file, rank, to_square,  1, -1, 7) ||
-				can_reach(chessboard, file, rank, to_square, -1, -1, 7) ||
-				can_reach(chessboard, file, rank, to_square, -1,  1, 7))
-				return true;
-			break;
-
 		case WHITE_KNIGHT: case BLACK_KNIGHT:
-			if (can_reach(chessboard, file, rank, to_square,  1,  2, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1,  2, 1) ||
-				can_reach(chessboard, file, rank, to_square,  2,  1, 1) ||
-				can_reach(chessboard, file, rank, to_square,  2, -1, 1) ||
-				can_reach(chessboard, file, rank, to_square,  1, -2, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1, -2, 1) ||
-				can_reach(chessboard, file, rank, to_square, -2,  1, 1) ||
-				can_reach(chessboard, file, rank, to_square, -2, -1, 1))
-				return true;
+			get_moves(legal_moves, &i, game, targets & allowed);
 			break;
 
-		case WHITE_PAWN:
-			if (can_reach(chessboard, file, rank, to_square,  1,  1, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1,  1, 1))
-				return true;
-			break;
+		case WHITE_PAWN:   case BLACK_PAWN:
+			if (en_passant_target_square != NO_SQUARE && !(rule_targets & BIT(en_passant_target_square)))
+				en_passant_target_square = NO_SQUARE;
+			get_move_pawn_forward(legal_moves, i, &j, game, square, allowed & rule_targets);
+			get_move_pawn_capture(legal_moves, i, &j, game, safety, square, en_passant_target_square, allowed & rule_targets);
 
-		case BLACK_PAWN:
-			if (can_reach(chessboard, file, rank, to_square,  1, -1, 1) ||
-				can_reach(chessboard, file, rank, to_square, -1, -1, 1))
-				return true;
+			if ((color == WHITE && RANK(square) == ('1' + NUM_RANKS - 2)) || (color == BLACK && RANK(square) == '2')) // pawn promotion
+			{
+				for (int k = 0; k < j; k++)
+				{
+					legal_moves[i + k +   j] = legal_moves[i + k];
+					legal_moves[i + k + 2*j] = legal_moves[i + k];
+					legal_moves[i + k + 3*j] = legal_moves[i + k];
+					legal_moves[i + k      ].promoted_piece = (color == WHITE) ? WHITE_QUEEN  : BLACK_QUEEN;
+					legal_moves[i + k +   j].promoted_piece = (color == WHITE) ? WHITE_ROOK   : BLACK_ROOK;
+					legal_moves[i + k + 2*j].promoted_piece = (color == WHITE) ? WHITE_BISHOP : BLACK_BISHOP;
+					legal_moves[i + k + 3*j].promoted_piece = (color == WHITE) ? WHITE_KNIGHT : BLACK_KNIGHT;
+				}
+				j *= 4;
+			}
+			i += j;
 			break;
 	}
 
-	return false;
+	return i;
 }
 
 
-bool
-square_is_attacked(char *chessboard, int color, int square)
+void
+remove_piece(game_state *game, int square)
+{
+	char piece = game->chessboard[square];
+
+	if (IS_EMPTY(piece))
+		return;
+
+	game->piece_bitboard[BITBOARD_INDEX(piece)] ^= BIT(square);
+	game->color_bitboard[COLOR(piece)] ^= BIT(square);
+	game->occupied_bitboard ^= BIT(square);
+	game->key ^= zobrist_piece[BITBOARD_INDEX(piece)][square];
+	game->material -= MATERIAL_UNIT(BITBOARD_INDEX(piece));
+	game->chessboard[square] = EMPTY;
+}
+
+
+void
+put_piece(game_state *game, int square, char piece)
+{
+	remove_piece(game, square);
+
+	game->piece_bitboard[BITBOARD_INDEX(piece)] |= BIT(square);
+	game->color_bitboard[COLOR(piece)] |= BIT(square);
+	game->occupied_bitboard |= BIT(square);
+	game->key ^= zobrist_piece[BITBOARD_INDEX(piece)][square];
+	game->material += MATERIAL_UNIT(BITBOARD_INDEX(piece));
+	game->chessboard[square] = piece;
+}
+
+
+void
+set_bitboards(game_state *game)
+{
+	memset(game->piece_bitboard, 0, sizeof(game->piece_bitboard));
+	memset(game->color_bitboard, 0, sizeof(game->color_bitboard));
+	game->occupied_bitboard = 0;
+	game->key = 0;
+	game->material = 0;
+
+	char chessboard[NUM_SQUARES];
+	memcpy(chessboard, game->chessboard, NUM_SQUARES);
+	memset(game->chessboard, EMPTY, NUM_SQUARES);
+
+	for (int square = 0; square < NUM_SQUARES; square++)
+		if (IS_PIECE(chessboard[square]))
+			put_piece(game, square, chessboard[square]);
+}
+
+
+void
+init_zobrist_keys()
 {
-	for (int attacking_square = 0; attacking_square < NUM_SQUARES; attacking_square++)
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	uint64_t *keys[] = {&zobrist_black_to_move, zobrist_castling, zobrist_en_passant, &zobrist_piece[0][0]};
+	int key_count[] = {1, 4, NUM_FILES, NUM_BITBOARDS * NUM_SQUARES};
+
+	for (int k = 0; k < 4; k++)
 	{
-		char piece = chessboard[attacking_square];
+		for (int i = 0; i < key_count[k]; i++)
+		{
+			seed ^= seed >> 12; // xorshift64*, fixed seed: keys are the same on every run
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			keys[k][i] = seed * 2685821657736338717ULL;
+		}
+	}
+}
 
-		if (IS_EMPTY(piece) || (color == COLOR(piece)))
-			continue;
 
-		if (square_is_attacked_by_piece(chessboard, attacking_square, square, piece))
-			return true;
+uint64_t
+state_key(game_state *game)
+{
+	uint64_t key = (game->side_to_move == BLACK) ? zobrist_black_to_move : 0;
+
+	key ^= game->white_castling_short_ability ? zobrist_castling[0] : 0;
+	key ^= game->white_castling_long_ability  ? zobrist_castling[1] : 0;
+	key ^= game->black_castling_short_ability ? zobrist_castling[2] : 0;
+	key ^= game->black_castling_long_ability  ? zobrist_castling[3] : 0;
+
+	// The en passant file only counts when a pawn can capture there, otherwise the position repeats without it
+	int opponent = (game->side_to_move == WHITE) ? BLACK : WHITE;
+	uint64_t pawns = game->piece_bitboard[BITBOARD_INDEX((game->side_to_move == WHITE) ? WHITE_PAWN : BLACK_PAWN)];
+	if (game->en_passant_target_square != NO_SQUARE && (pawn_attacks[opponent][game->en_passant_target_square] & pawns))
+		key ^= zobrist_en_passant[game->en_passant_target_square % NUM_FILES];
+
+	return key;
+}
+
+
+void
+update_castling_abilities(game_state *game, int square)
+{
+	// A move from or to the home square of a king or a rook ends the castling abilities that depend on it
+	if (square == SQUARE('e','1') || square == SQUARE('h','1'))
+		game->white_castling_short_ability = false;
+	if (square == SQUARE('e','1') || square == SQUARE('a','1'))
+		game->white_castling_long_ability  = false;
+	if (square == SQUARE('e','8') || square == SQUARE('h','8'))
+		game->black_castling_short_ability = false;
+	if (square == SQUARE('e','8') || square == SQUARE('a','8'))
+		game->black_castling_long_ability  = false;
+}
+
+
+void
+move_pieces(game_state *game, piece_move *move)
+{
+	// Chessboard and bitboards only: the captured piece, the moving piece or its promotion, and the rook of castling
+	remove_piece(game, move->en_passant ? SQUARE(FILE(move->to_square), RANK(move->from_square)) : move->to_square);
+	remove_piece(game, move->from_square);
+	put_piece(game, move->to_square, IS_PIECE(move->promoted_piece) ? move->promoted_piece : move->moving_piece);
+
+	if (IS_KING(move->moving_piece) && FILE(move->from_square) == 'e') // Castling
+	{
+		char rook = (COLOR(move->moving_piece) == WHITE) ? WHITE_ROOK : BLACK_ROOK;
+
+		if (FILE(move->to_square) == 'g')
+		{
+			remove_piece(game, move->from_square + 3);
+			put_piece(game, move->from_square + 1, rook);
+		}
+		else if (FILE(move->to_square) == 'c')
+		{
+			remove_piece(game, move->from_square - 4);
+			put_piece(game, move->from_square - 1, rook);
+		}
 	}
+}
 
-	return false;
+
+void
+make_move(game_state *game, piece_move *move)
+{
+	undo_record *undo = &game_history[game->ply++];
+
+	undo->move = move;
+	undo->captured_square = move->en_passant ? SQUARE(FILE(move->to_square), RANK(move->from_square)) : move->to_square;
+	undo->captured_piece  = game->chessboard[undo->captured_square];
+	undo->white_castling_short_ability = game->white_castling_short_ability;
+	undo->white_castling_long_ability  = game->white_castling_long_ability;
+	undo->black_castling_short_ability = game->black_castling_short_ability;
+	undo->black_castling_long_ability  = game->black_castling_long_ability;
+	undo->en_passant_target_square = game->en_passant_target_square;
+	undo->half_move_clock = game->half_move_clock;
+	key_history[game->ply - 1] = game->key;
+
+	game->key ^= state_key(game);
+
+	move_pieces(game, move);
+
+	update_castling_abilities(game, move->from_square);
+	update_castling_abilities(game, move->to_square);
+
+	game->en_passant_target_square = NO_SQUARE;
+	if (IS_PAWN(move->moving_piece) && abs(move->to_square - move->from_square) == 2 * NUM_FILES)
+		game->en_passant_target_square = (move->from_square + move->to_square) / 2;
+
+	game->half_move_clock++;
+	if (IS_PAWN(move->moving_piece) || move->capture)
+		game->half_move_clock = 0;
+
+	game->full_move_counter += (game->side_to_move == BLACK);
+	game->side_to_move = (game->side_to_move == WHITE) ? BLACK : WHITE;
+
+	game->key ^= state_key(game);
 }
 
 
-bool
-castling_under_attack(char *chessboard, piece_move *move)
+void
+unmake_move(game_state *game)
 {
-	if (!IS_KING(move->moving_piece))
-		return false;
+	undo_record *undo = &game_history[--game->ply];
+	piece_move *move = undo->move;
 
-	int color = COLOR(chessboard[move->to_square]);
-	char file = 'e';
-	char rank = (color == WHITE) ? '1' : '8';
-	int king_initial_square = SQUARE(file, rank);
-	int file_step = (move->to_square - move->from_square);
-	if ((move->from_square != king_initial_square) || (abs(file_step) != 2))
-		return false;
+	game->side_to_move = (game->side_to_move == WHITE) ? BLACK : WHITE;
+	game->full_move_counter -= (game->side_to_move == BLACK);
 
-	if (square_is_attacked(chessboard, color, king_initial_square))
-		return true;
+	if (IS_KING(move->moving_piece) && FILE(move->from_square) == 'e') // Castling
+	{
+		char rook = (COLOR(move->moving_piece) == WHITE) ? WHITE_ROOK : BLACK_ROOK;
 
-	int king_middle_square = SQUARE(file + (file_step / 2), rank);
-	if (square_is_attacked(chessboard, color, king_middle_square))
-		return true;
+		if (FILE(move->to_square) == 'g')
+		{
+			remove_piece(game, move->from_square + 1);
+			put_piece(game, move->from_square + 3, rook);
+		}
+		else if (FILE(move->to_square) == 'c')
+		{
+			remove_piece(game, move->from_square - 1);
+			put_piece(game, move->from_square - 4, rook);
+		}
+	}
 
-	return false;
+	remove_piece(game, move->to_square);
+	put_piece(game, move->from_square, move->moving_piece);
+	if (IS_PIECE(undo->captured_piece))
+		put_piece(game, undo->captured_square, undo->captured_piece);
+
+	game->white_castling_short_ability = undo->white_castling_short_ability;
+	game->white_castling_long_ability  = undo->white_castling_long_ability;
+	game->black_castling_short_ability = undo->black_castling_short_ability;
+	game->black_castling_long_ability  = undo->black_castling_long_ability;
+	game->en_passant_target_square = undo->en_passant_target_square;
+	game->half_move_clock = undo->half_move_clock;
+	game->key = key_history[game->ply];
+}
+
+
+piece_move *
+last_move(game_state *game)
+{
+	piece_move *move = (game->ply > 0) ? game_history[game->ply - 1].move : NULL;
+
+	return move;
+}
+
+
+void
+set_game_state(game_state *game, char *chessboard = initial_chessboard, int side_to_move = WHITE, int full_move_counter = 1)
+{
+	memcpy(game->chessboard, chessboard, NUM_SQUARES);
+	set_bitboards(game);
+	game->side_to_move = side_to_move;
+	game->white_castling_short_ability = (chessboard[SQUARE('e','1')] == WHITE_KING && chessboard[SQUARE('h','1')] == WHITE_ROOK);
+	game->white_castling_long_ability  = (chessboard[SQUARE('e','1')] == WHITE_KING && chessboard[SQUARE('a','1')] == WHITE_ROOK);
+	game->black_castling_short_ability = (chessboard[SQUARE('e','8')] == BLACK_KING && chessboard[SQUARE('h','8')] == BLACK_ROOK);
+	game->black_castling_long_ability  = (chessboard[SQUARE('e','8')] == BLACK_KING && chessboard[SQUARE('a','8')] == BLACK_ROOK);
+	game->en_passant_target_square = NO_SQUARE;
+	game->half_move_clock = 0;
+	game->full_move_counter = full_move_counter;
+	game->ply = 0;
+
+	game->key ^= state_key(game);
+}
+
+
+int
+fen_game_state(game_state *game, char const *fen_text)
+{
+	// Piece placement, then active color, castling availability, en passant target square, half move clock and full move number
+	char chessboard[NUM_SQUARES];
+	int error = fen_piece_placement(chessboard, fen_text);
+	if (error)
+		return error;
+
+	char side[2] = "w", castling[5] = "KQkq", en_passant[3] = "-";
+	int half_move_clock = 0, full_move_counter = 1;
+	char const *fields = strchr(fen_text, ' ');
+	if (fields)
+	{
+		// Every field given must be read, the missing ones keep their defaults
+		int field_count = 0;
+		for (char const *c = fields; *c != 0; c++)
+			field_count += (*c != ' ' && (c[-1] == ' '));
+
+		int read_count = field_count ? sscanf(fields, "%1s %4s %2s %d %d", side, castling, en_passant, &half_move_clock,
+											  &full_move_counter) : 0;
+		if (field_count > 5 || read_count != field_count)
+			return error_fen(1, "Invalid FEN syntax", fen_text, fields + 1);
+	}
+
+	if (strcmp(side, "w") != 0 && strcmp(side, "b") != 0)
+		return error_fen(8, "Invalid active color", fen_text, fields + 1);
+
+	if (strspn(castling, "KQkq") != strlen(castling) && strcmp(castling, "-") != 0)
+		return error_fen(9, "Invalid castling availability", fen_text, fields + 1);
+
+	if (strcmp(en_passant, "-") != 0 && (strlen(en_passant) != 2 || en_passant[0] < 'a' || en_passant[0] > 'h' ||
+										 en_passant[1] != (side[0] == 'w' ? '6' : '3')))
+		return error_fen(10, "Invalid en passant target square", fen_text, fields + 1);
+
+	if (half_move_clock < 0)
+		return error_fen(11, "Invalid half move clock", fen_text, fields + 1);
+
+	if (full_move_counter < 1)
+		return error_fen(12, "Invalid full move number", fen_text, fields + 1);
+
+	set_game_state(game, chessboard, (side[0] == 'w') ? WHITE : BLACK, full_move_counter);
+
+	game->key ^= state_key(game);
+	game->white_castling_short_ability &= (strchr(castling, 'K') != NULL);
+	game->white_castling_long_ability  &= (strchr(castling, 'Q') != NULL);
+	game->black_castling_short_ability &= (strchr(castling, 'k') != NULL);
+	game->black_castling_long_ability  &= (strchr(castling, 'q') != NULL);
+	game->en_passant_target_square = (en_passant[0] == '-') ? NO_SQUARE : SQUARE(en_passant[0], en_passant[1]);
+	game->half_move_clock = half_move_clock;
+	game->key ^= state_key(game);
+
+	return 0;
+}
+
+
+int
+get_game_fen(char *fen_text, game_state *game)
+{
+	// Inverse of fen_game_state
+	int len = 0;
+
+	for (int rank = 0; rank < NUM_RANKS; rank++)
+	{
+		int empty_squares = 0;
+
+		for (int file = 0; file < NUM_FILES; file++)
+		{
+			char piece = game->chessboard[rank * NUM_FILES + file];
+
+			if (IS_EMPTY(piece))
+				empty_squares++;
+			else
+			{
+				if (empty_squares)
+					fen_text[len++] = '0' + empty_squares;
+				fen_text[len++] = piece;
+				empty_squares = 0;
+			}
+		}
+
+		if (empty_squares)
+			fen_text[len++] = '0' + empty_squares;
+		if (rank < NUM_RANKS - 1)
+			fen_text[len++] = RANK_SEPARATOR;
+	}
+
+	char castling[5] = "-", en_passant[3] = "-";
+	int castling_len = 0;
+	if (game->white_castling_short_ability)
+		castling[castling_len++] = 'K';
+	if (game->white_castling_long_ability)
+		castling[castling_len++] = 'Q';
+	if (game->black_castling_short_ability)
+		castling[castling_len++] = 'k';
+	if (game->black_castling_long_ability)
+		castling[castling_len++] = 'q';
+	if (castling_len)
+		castling[castling_len] = 0;
+
+	if (game->en_passant_target_square != NO_SQUARE)
+		sprintf(en_passant, "%c%c", FILE(game->en_passant_target_square), RANK(game->en_passant_target_square));
+
+	len += sprintf(fen_text + len, " %c %s %s %d %d", (game->side_to_move == WHITE) ? 'w' : 'b', castling, en_passant,
+				   game->half_move_clock, game->full_move_counter);
+
+	return len;
+}
+
+
+bool
+square_is_attacked(game_state *game, int color, int square)
+{
+	// Attacked by any piece of the other player
+	bool attacked = (attackers_to(game, square, game->occupied_bitboard) & game->color_bitboard[!color]) != 0;
+
+	return attacked;
 }
 
 
 bool
-king_in_check(char *chessboard, int color)
+king_in_check(game_state *game, int color)
 {
 	char king = (color == WHITE) ? WHITE_KING : BLACK_KING;
-	int square = strchr(chessboard, king) - chessboard;
-	bool attacked = square_is_attacked(chessboard, color, square);
+	int square = LSB(game->piece_bitboard[BITBOARD_INDEX(king)]);
+	bool attacked = square_is_attacked(game, color, square);
 
 	return attacked;
 }
@@ -725,45 +1549,35 @@ forced_draw(game_state *game)
 		return true;
 
 	// Draw Rule #2: Insufficient mating material: a single bishop or a single knight
-	bool minor_pieces_only = true;
-	int white_bishops_w = 0, white_bishops_b = 0, white_knights = 0, black_bishops_w = 0, black_bishops_b = 0, black_knights = 0;
-	for (int square = 0; square < NUM_SQUARES; square++)
+	// Bishops on squares of the same color count as one, so only the material signature and the bishops are looked at
+	if (!(game->material & MAJOR_MATERIAL_MASK))
 	{
-		char piece = game->chessboard[square];
-		if (IS_EMPTY(piece) || IS_KING(piece))
-			continue;
-
-		if (IS_QUEEN(piece) || IS_ROOK(piece) || IS_PAWN(piece))
-		{
-			minor_pieces_only = false;
-			break;
-		}
-
-		white_bishops_w |= (piece == WHITE_BISHOP && IS_WHITE_SQUARE(square));
-		white_bishops_b |= (piece == WHITE_BISHOP && IS_BLACK_SQUARE(square));
-		white_knights   += (piece == WHITE_KNIGHT);
-		black_bishops_w |= (piece == BLACK_BISHOP && IS_WHITE_SQUARE(square));
-		black_bishops_b |= (piece == BLACK_BISHOP && IS_BLACK_SQUARE(square));
-		black_knights   += (piece == BLACK_KNIGHT);
+		uint64_t white_bishops = game->piece_bitboard[BITBOARD_INDEX(WHITE_BISHOP)];
+		uint64_t black_bishops = game->piece_bitboard[BITBOARD_INDEX(BLACK_BISHOP)];
+		int white_minor_pieces = MATERIAL_COUNT(game->material, BITBOARD_INDEX(WHITE_KNIGHT)) +
+								 ((white_bishops & WHITE_SQUARES_BITBOARD) != 0) + ((white_bishops & ~WHITE_SQUARES_BITBOARD) != 0);
+		int black_minor_pieces = MATERIAL_COUNT(game->material, BITBOARD_INDEX(BLACK_KNIGHT)) +
+								 ((black_bishops & WHITE_SQUARES_BITBOARD) != 0) + ((black_bishops & ~WHITE_SQUARES_BITBOARD) != 0);
+
+		if (white_minor_pieces < 2 && black_minor_pieces < 2)
+			return true;
 	}
-	if (minor_pieces_only && (white_bishops_w + white_bishops_b + white_knights) < 2 &&
-							 (black_bishops_w + black_bishops_b + black_knights) < 2)
-		return true;
 
 	// Draw Rule #3: Threefold repetition: the same position is reached three times with the same player to move
-	char *chessboard = game->chessboard;
-	int side_to_move = game->side_to_move;
+	// Only positions since the last capture or pawn move can repeat, and only every second ply has the same player to move.
+	// The half move clock of the initial FEN may go back before the first ply of the history
 	int repetitions = 0;
-	game_state *old_game = game->previous;
-	while(old_game != NULL && old_game->half_move_clock > 0)
+	for (int ply = game->ply - 4; ply >= max(0, game->ply - game->half_move_clock); ply -= 2)
 	{
-		if (old_game->side_to_move == side_to_move && strncmp(old_game->chessboard, chessboard, NUM_SQUARES) == 0)
+		if (key_history[ply] == game->key) // the key covers chessboard, player to move, castling and en passant abilities
 		{
 			repetitions++;
-			if (repetitions >= 3)
+			if (repetitions >= 2)
+			{
+				repetition_draws++;
 				return true;
+			}
 		}
-		old_game = old_game->previous;
 	}
 
 	return false;
@@ -771,7 +1585,7 @@ forced_draw(game_state *game)
 
 
 void
-move_disambiguation(piece_move *move, char *chessboard)
+move_disambiguation(piece_move *move, game_state *game)
 {
 	char piece = move->moving_piece;
 
@@ -779,36 +1593,36 @@ move_disambiguation(piece_move *move, char *chessboard)
 		return;
 
 	char file_from = FILE(move->from_square);
-	char rank_from = RANK(move->from_square);
 
-	for (int square = 0; square < NUM_SQUARES; square++)
+	// Other pieces of the same kind that reach the same square: attacks of pieces but pawns are symmetric
+	uint64_t pieces = game->piece_bitboard[BITBOARD_INDEX(piece)] & ~BIT(move->from_square) &
+					  piece_attacks(piece, move->to_square, game->occupied_bitboard);
+
+	while (pieces)
 	{
-		if ((chessboard[square] != piece) || (square == move->from_square))
-			continue;
+		int square = LSB(pieces);
+		pieces &= pieces - 1;
 
-		if (square_is_attacked_by_piece(chessboard, square, move->to_square, piece))
-		{
-			if (FILE(square) != file_from)
-				move->file_ambiguity = true;
-			else
-				move->rank_ambiguity = true;
+		if (FILE(square) != file_from)
+			move->file_ambiguity = true;
+		else
+			move->rank_ambiguity = true;
 
-			if (move->file_ambiguity && move->rank_ambiguity)
-				return;
-		}
+		if (move->file_ambiguity && move->rank_ambiguity)
+			return;
 	}
 }
 
 
 int
-get_move_count_text(char *move_count_text, game_state *game, bool start)
+get_move_count_text(char *move_count_text, int side_to_move, int full_move_counter, bool start)
 {
 	int len = 0;
 
-	if (game->side_to_move == BLACK)
-		sprintf(move_count_text, "%d. %n", game->full_move_counter, &len);
-	else if (game->side_to_move == WHITE && start)
-		sprintf(move_count_text, "%d... %n", (game->full_move_counter - 1), &len);
+	if (side_to_move == BLACK)
+		sprintf(move_count_text, "%d. %n", full_move_counter, &len);
+	else if (side_to_move == WHITE && start)
+		sprintf(move_count_text, "%d... %n", (full_move_counter - 1), &len);
 
 	return len;
 }
@@ -856,30 +1670,72 @@ get_move_text(char *move_text, piece_move *move)
 
 
 int
-get_move_list(char *move_list, game_state *game, int start_move_counter = 1, int start_side_to_move = WHITE)
+get_coordinate_move_text(char *move_text, piece_move *move)
 {
-	if (game == NULL || game->last_move == NULL || game->full_move_counter < start_move_counter ||
-		(game->full_move_counter == start_move_counter && game->side_to_move < start_side_to_move))
-		return 0;
-
-	int len = get_move_list(move_list, game->previous, start_move_counter, start_side_to_move);
-
-	bool start = (game->full_move_counter == start_move_counter && game->side_to_move == start_side_to_move);
-	move_list[len++] = ' ';
-	len += get_move_count_text(move_list + len, game, start);
-	len += get_move_text(move_list + len, game->last_move);
+	// From and to squares, with the promoted piece in lowercase
+	int len = sprintf(move_text, "%c%c%c%c", FILE(move->from_square), RANK(move->from_square), FILE(move->to_square), RANK(move->to_square));
+	if (IS_PIECE(move->promoted_piece))
+		len += sprintf(move_text + len, "%c", tolower(move->promoted_piece));
 
 	return len;
 }
 
 
-bool
-first_move(game_state *game)
+int
+get_move_list_text(char *move_list, game_state *chessboard, piece_move *variant, int plies, int start_move_counter, int start_side_to_move)
 {
-	bool is_first_move = (game->previous == NULL);
+	// The text is only made when printed, so moves are disambiguated here, replayed from the initial chessboard
+	int len = 0;
+	int side_to_move = chessboard->side_to_move;
+	int full_move_counter = chessboard->full_move_counter;
 
-	return is_first_move;
-}
+	for (int ply = 0; ply < plies; ply++)
+	{
+		piece_move move = variant[ply];
+		move_disambiguation(&move, chessboard);
+		move_pieces(chessboard, &move);
+
+		full_move_counter += (side_to_move == BLACK);
+		side_to_move = (side_to_move == WHITE) ? BLACK : WHITE;
+
+		if (full_move_counter < start_move_counter || (full_move_counter == start_move_counter && side_to_move < start_side_to_move))
+			continue;
+
+		bool start = (full_move_counter == start_move_counter && side_to_move == start_side_to_move);
+		move_list[len++] = ' ';
+		len += get_move_count_text(move_list + len, side_to_move, full_move_counter, start);
+		len += get_move_text(move_list + len, &move);
+	}
+
+	return len;
+}
+
+
+int
+get_move_list(char *move_list, game_state *game, int start_move_counter = 1, int start_side_to_move = WHITE)
+{
+	game_state chessboard = *game;
+	piece_move variant[MAX_GAME_PLIES];
+
+	for (int ply = 0; ply < game->ply; ply++)
+		variant[ply] = *game_history[ply].move;
+
+	while (chessboard.ply > 0) // back to the initial chessboard, on a copy: the search state is only read
+		unmake_move(&chessboard);
+
+	int len = get_move_list_text(move_list, &chessboard, variant, game->ply, start_move_counter, start_side_to_move);
+
+	return len;
+}
+
+
+bool
+first_move(game_state *game)
+{
+	bool is_first_move = (game->ply == 0);
+
+	return is_first_move;
+}
 
 
 bool
@@ -891,80 +1747,268 @@ goal_chessboard_achieved(game_state *game, char *goal_chessboard)
 }
 
 
-void
-format_commas(char *formatted_number, long num)
+uint64_t
+placement_key(game_state *game)
 {
-	char str_num[80], *fn = formatted_number;
-	int last = sprintf(str_num, "%ld", num) - 1;
+	// Key of chessboard and side to move only: the backward search does not know castling and en passant abilities
+	uint64_t key = game->key ^ state_key(game);
 
-	for (int i = 0; i <= last; i++)
+	return (game->side_to_move == BLACK) ? (key ^ zobrist_black_to_move) : key;
+}
+
+
+int
+remaining_plies(game_state *game)
+{
+	// Plies still allowed before finish_variant cuts the variant; the final chessboard is reached with the initial side to move
+	int limit = min(min_move_count_chessboard, max_full_move_count);
+
+	return 2 * (limit + 1 - game->full_move_counter) - (game->side_to_move != initial_side_to_move);
+}
+
+
+bool
+final_chessboard_unreachable(game_state *game)
+{
+	// Meet in the middle: close enough to the end, only positions found by the backward search can reach the final chessboard
+	if (retro_distance.empty())
+		return false;
+
+	int plies = remaining_plies(game);
+	if (plies > retro_depth)
+		return false;
+
+	unordered_map<uint64_t, int>::iterator position = retro_distance.find(placement_key(game));
+	bool unreachable = (position == retro_distance.end() || position->second > plies);
+
+	return unreachable;
+}
+
+
+int
+pawn_distance(int from_square, int to_square, int color)
+{
+	// Moves of a pawn to a square ahead: one capture per file changed, and a double step from the initial rank
+	int ranks = (color == WHITE) ? (RANK(to_square) - RANK(from_square)) : (RANK(from_square) - RANK(to_square));
+	int files = abs(FILE(to_square) - FILE(from_square));
+	bool initial_rank = (RANK(from_square) == ((color == WHITE) ? '2' : '7'));
+
+	if (ranks < files)
+		return NO_DISTANCE;
+
+	return (initial_rank && (ranks - files) >= 2) ? (ranks - 1) : ranks;
+}
+
+
+int
+chessboard_moves_lower_bound(game_state *game, int color)
+{
+	// Each piece of the final chessboard not yet on its square needs the moves of the closest piece that can become it,
+	// and every piece of the other player beyond those of the final chessboard needs a capture
+	char const *pieces = (color == WHITE) ? WHITE_PIECES : BLACK_PIECES;
+	uint64_t pawns = game->piece_bitboard[BITBOARD_INDEX(pieces[0])];
+	uint64_t last_rank = (color == WHITE) ? RANK_8_BITBOARD : RANK_1_BITBOARD;
+	int moves = 0;
+
+	for (uint64_t targets = final_game.color_bitboard[color]; targets; targets &= targets - 1)
 	{
-		*fn++ = str_num[i];
-		if ((last - i) % 3 == 0)
-			*fn++ = ',';
+		int square = LSB(targets);
+		char piece = final_chessboard[square];
+		if (game->chessboard[square] == piece)
+			continue;
+
+		int type = BITBOARD_INDEX(toupper(piece));
+		int distance = NO_DISTANCE;
+
+		if (IS_PAWN(piece))
+		{
+			for (uint64_t from = pawns; from; from &= from - 1)
+				distance = min(distance, pawn_distance(LSB(from), square, color));
+		}
+		else
+		{
+			for (uint64_t from = game->piece_bitboard[BITBOARD_INDEX(piece)]; from; from &= from - 1)
+				distance = min(distance, piece_distance[type][LSB(from)][square]);
+
+			if (!IS_KING(piece)) // a pawn promoted on any square of the last rank
+				for (uint64_t from = pawns; from; from &= from - 1)
+					for (uint64_t promotion = last_rank; promotion; promotion &= promotion - 1)
+						distance = min(distance, pawn_distance(LSB(from), LSB(promotion), color) +
+												 piece_distance[type][LSB(promotion)][square]);
+		}
+
+		if (distance >= NO_DISTANCE)
+			return NO_DISTANCE;
+		moves += distance;
 	}
-	*(--fn) = 0;
+
+	// Castling moves the king and a rook at once, saving up to two of the moves above, but only if the king must move
+	char king = pieces[5];
+	bool castling = (color == WHITE) ? (game->white_castling_short_ability || game->white_castling_long_ability) :
+									   (game->black_castling_short_ability || game->black_castling_long_ability);
+	if (castling && game->piece_bitboard[BITBOARD_INDEX(king)] != final_game.piece_bitboard[BITBOARD_INDEX(king)])
+		moves = max(0, moves - 2);
+
+	int captures = POPCOUNT(game->color_bitboard[!color]) - POPCOUNT(final_game.color_bitboard[!color]);
+
+	return max(moves, captures);
 }
 
 
 void
-print_stats(stats_type type)
+count_material(game_state *game, int color, int *material)
 {
-	char stats_line[2000], variants_analyzed_str[80], mate_results_str[80], draw_results_str[80], chessboard_results_str[80];
-	char *text = stats_line;
-	int len = 0;
+	char const *pieces = (color == WHITE) ? WHITE_PIECES : BLACK_PIECES;
+	uint64_t bishops = game->piece_bitboard[BITBOARD_INDEX(pieces[2])];
+
+	material[MATERIAL_PAWNS]   = POPCOUNT(game->piece_bitboard[BITBOARD_INDEX(pieces[0])]);
+	material[MATERIAL_KNIGHTS] = POPCOUNT(game->piece_bitboard[BITBOARD_INDEX(pieces[1])]);
+	material[MATERIAL_WHITE_SQUARE_BISHOPS] = POPCOUNT(bishops & WHITE_SQUARES_BITBOARD);
+	material[MATERIAL_BLACK_SQUARE_BISHOPS] = POPCOUNT(bishops & ~WHITE_SQUARES_BITBOARD);
+	material[MATERIAL_ROOKS]   = POPCOUNT(game->piece_bitboard[BITBOARD_INDEX(pieces[3])]);
+	material[MATERIAL_QUEENS]  = POPCOUNT(game->piece_bitboard[BITBOARD_INDEX(pieces[4])]);
+	material[MATERIAL_PIECES]  = POPCOUNT(game->color_bitboard[color]);
+}
 
-	if (type == TEMPORARY)
-		sprintf(text += len, "\nTemporary results:\n%n", &len);
-	else if (type == FINAL)
-		sprintf(text += len, "\n%n", &len);
 
-	format_commas(variants_analyzed_str, variants_analyzed);
-	sprintf(text += len, "Variants analyzed: %s   %n", variants_analyzed_str, &len);
+bool
+match_final_pawn(int target, int *reachable_pawns, int *pawn_target, int *visited_pawns)
+{
+	// Augmenting path: the target takes a free pawn, or one whose target can take another pawn
+	for (int pawn = 0; pawn < NUM_PAWNS; pawn++)
+	{
+		if (!(reachable_pawns[target] & (1 << pawn)) || (*visited_pawns & (1 << pawn)))
+			continue;
 
-	if (goal_is_mate)
+		*visited_pawns |= 1 << pawn;
+		if (pawn_target[pawn] < 0 || match_final_pawn(pawn_target[pawn], reachable_pawns, pawn_target, visited_pawns))
+		{
+			pawn_target[pawn] = target;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+bool
+final_pawns_unreachable(game_state *game, int color, int captures)
+{
+	// Each pawn of the final chessboard needs a pawn of its own, which changes files only by capturing
+	uint64_t pawns = game->piece_bitboard[BITBOARD_INDEX((color == WHITE) ? WHITE_PAWN : BLACK_PAWN)];
+	int pawn_square[NUM_PAWNS], reachable_pawns[NUM_PAWNS], pawn_target[NUM_PAWNS];
+	int num_pawns = 0, num_targets = 0, file_changes = 0;
+
+	for (; pawns; pawns &= pawns - 1)
+		pawn_square[num_pawns++] = LSB(pawns);
+
+	for (uint64_t targets = final_game.piece_bitboard[BITBOARD_INDEX((color == WHITE) ? WHITE_PAWN : BLACK_PAWN)];
+		 targets; targets &= targets - 1, num_targets++)
 	{
-		format_commas(mate_results_str, mate_variant.size());
-		sprintf(text += len, "Mate solutions: %s   %n", mate_results_str, &len);
-		if (mate_variant.size() > 0)
-			sprintf(text += len, "Move count: %d   %n", min_move_count_mate, &len);
+		int square = LSB(targets);
+		int fewest_files = NO_DISTANCE;
+
+		reachable_pawns[num_targets] = 0;
+		for (int pawn = 0; pawn < num_pawns; pawn++)
+		{
+			if (pawn_distance(pawn_square[pawn], square, color) < NO_DISTANCE)
+			{
+				reachable_pawns[num_targets] |= 1 << pawn;
+				fewest_files = min(fewest_files, abs(FILE(square) - FILE(pawn_square[pawn])));
+			}
+		}
+
+		if (reachable_pawns[num_targets] == 0)
+			return true;
+		file_changes += fewest_files;
 	}
 
-	if (goal_is_draw)
+	if (file_changes > captures)
+		return true;
+
+	for (int pawn = 0; pawn < num_pawns; pawn++)
+		pawn_target[pawn] = -1;
+
+	for (int target = 0; target < num_targets; target++)
 	{
-		format_commas(draw_results_str, draw_variant.size());
-		sprintf(text += len, "Draw solutions: %s   %n", draw_results_str, &len);
-		if (draw_variant.size() > 0)
-			sprintf(text += len, "Move count: %d   %n", min_move_count_draw, &len);
+		int visited_pawns = 0;
+		if (!match_final_pawn(target, reachable_pawns, pawn_target, &visited_pawns))
+			return true;
 	}
 
-	if (goal_is_chessboard)
+	return false;
+}
+
+
+bool
+final_chessboard_infeasible(game_state *game)
+{
+	// Rules derived from the final chessboard that no sequence of moves can overcome. Material and pawns only change
+	// with captures and pawn moves, so after other moves the position passes as its parent did
+	if (game->half_move_clock > 0 && game->ply > 0)
+		return false;
+
+	for (int color = WHITE; color <= BLACK; color++)
 	{
-		format_commas(chessboard_results_str, chessboard_variant.size());
-		sprintf(text += len, "Chessboard solutions: %s   %n", chessboard_results_str, &len);
-		if (chessboard_variant.size() > 0)
-			sprintf(text += len, "Move count: %d   %n", min_move_count_chessboard, &len);
+		int material[NUM_MATERIAL_TYPES], other_material[NUM_MATERIAL_TYPES];
+		count_material(game, color, material);
+		count_material(game, !color, other_material);
+		int *final_count = final_material[color];
+
+		// Rule #1: pieces are never created, and pawns only disappear
+		if (material[MATERIAL_PIECES] < final_count[MATERIAL_PIECES] || material[MATERIAL_PAWNS] < final_count[MATERIAL_PAWNS])
+			return true;
+
+		// Rule #2: missing pieces, bishops by square color, can only come from the pawns not needed on the final chessboard
+		int missing_pieces = 0;
+		for (int type = MATERIAL_KNIGHTS; type <= MATERIAL_QUEENS; type++)
+			missing_pieces += extra(final_count[type], material[type]);
+		if (missing_pieces > material[MATERIAL_PAWNS] - final_count[MATERIAL_PAWNS])
+			return true;
+
+		// Rule #3: pawns cannot move back, and their file changes use up captures of the pieces the other player can lose
+		if (final_pawns_unreachable(game, color, other_material[MATERIAL_PIECES] - final_material[!color][MATERIAL_PIECES]))
+			return true;
 	}
 
-	if (type == PERIODIC || type == TEMPORARY)
-		sprintf(text += len, "Last variant: %s   %n", last_variant_analyzed, &len);
+	return false;
+}
 
-	if (type == FINAL && save_results_name && (mate_variant.size() + draw_variant.size() + chessboard_variant.size()) > 0)
-		sprintf(text += len, "(See %s)%n", save_results_name, &len);
 
-	sprintf(text += len, "\n%n", &len);
+void
+init_final_chessboard_rules()
+{
+	set_game_state(&final_game, final_chessboard, initial_side_to_move);
+	count_material(&final_game, WHITE, final_material[WHITE]);
+	count_material(&final_game, BLACK, final_material[BLACK]);
+}
 
-	if (type == TEMPORARY || type == FINAL)
-		sprintf(text += len, "\n%n", &len);
 
-	printf("%s", stats_line);
+int
+chessboard_plies_lower_bound(game_state *game)
+{
+	// Plies in which both players can make the moves they still need, the side to move first
+	int moves = chessboard_moves_lower_bound(game, game->side_to_move);
+	int other_moves = chessboard_moves_lower_bound(game, !game->side_to_move);
 
-	if (type == FINAL && save_results_name)
+	return max(2 * moves - 1, 2 * other_moves);
+}
+
+
+void
+format_commas(char *formatted_number, long num)
+{
+	char str_num[80], *fn = formatted_number;
+	int last = sprintf(str_num, "%ld", num) - 1;
+
+	for (int i = 0; i <= last; i++)
 	{
-		save_results = fopen(save_results_name, "a");
-		fprintf(save_results, "%s", stats_line);
-		fclose(save_results);
+		*fn++ = str_num[i];
+		if ((last - i) % 3 == 0)
+			*fn++ = ',';
 	}
+	*(--fn) = 0;
 }
 
 
@@ -980,373 +2024,2817 @@ output_variant(char *print_line, int move_count, char const *move_list, char con
 }
 
 
-void
-print_variant(game_state *game, int verbose = 0, char const *highlight = NULL)
+uint16_t
+pack_move(piece_move *move)
 {
-	last_variant_analyzed[0] = 0;
-	get_move_list(last_variant_analyzed, game);
+	int promotion = IS_PIECE(move->promoted_piece) ? (strchr(PROMOTION_PIECES, toupper(move->promoted_piece)) - PROMOTION_PIECES) : 0;
+	uint16_t code = move->from_square | (move->to_square << 6) | (promotion << 12) | (move->mate << 14) | (move->draw << 15);
 
-	if (verbose)
+	return code;
+}
+
+
+void
+unpack_move(piece_move *move, uint16_t code, game_state *game)
+{
+	// The other fields of the move follow from the chessboard where it is played
+	int from_square = PACKED_FROM(code);
+	int to_square = PACKED_TO(code);
+	char piece = game->chessboard[from_square];
+
+	default_move(move, piece, from_square);
+	move->to_square = to_square;
+	move->en_passant = IS_PAWN(piece) && FILE(from_square) != FILE(to_square) && IS_EMPTY(game->chessboard[to_square]);
+	move->capture = !IS_EMPTY(game->chessboard[to_square]) || move->en_passant;
+	if (IS_PAWN(piece) && (RANK(to_square) == '8' || RANK(to_square) == '1'))
 	{
-		char print_line[4000];
-		int move_count = (game->side_to_move == WHITE) ? (game->full_move_counter - 1) : game->full_move_counter;
-		output_variant(print_line, move_count, last_variant_analyzed, highlight);
-		printf("%s\n", print_line);
+		char promoted_piece = PROMOTION_PIECES[PACKED_PROMOTION(code)];
+		move->promoted_piece = (COLOR(piece) == WHITE) ? promoted_piece : tolower(promoted_piece);
 	}
+	move->mate = PACKED_MATE(code);
+	move->draw = PACKED_DRAW(code);
 }
 
 
-long
-set_result(bool finish, bool mate, bool draw, bool chessboard, int move_count_mate, int move_count_draw, int move_count_chessboard)
+size_t
+variant_count(variant_trie *trie)
 {
-	long result = SET_FINISH(finish) | SET_MATE(mate) | SET_DRAW(draw) | SET_CHESSBOARD(chessboard);
+	size_t count = trie->nodes.empty() ? 0 : trie->nodes[0].solutions;
 
-	if (mate)
-		result |= SET_MOVE_COUNT_MATE((long) move_count_mate);
+	return count;
+}
 
-	if (draw)
-		result |= SET_MOVE_COUNT_DRAW((long) move_count_draw);
 
-	if (chessboard)
-		result |= SET_MOVE_COUNT_CHESSBOARD((long) move_count_chessboard);
+int
+new_variant_node(variant_trie *trie, int parent, uint16_t move)
+{
+	int node;
 
-	return result;
+	if (trie->free_nodes.empty())
+	{
+		node = trie->nodes.size();
+		trie->nodes.push_back(variant_node());
+	}
+	else
+	{	// The branch below a reused node is freed in turn
+		node = trie->free_nodes.back();
+		trie->free_nodes.pop_back();
+		for (int child = trie->nodes[node].first_child; child != NO_VARIANT_NODE; child = trie->nodes[child].next_sibling)
+			trie->free_nodes.push_back(child);
+	}
+
+	variant_node *new_node = &trie->nodes[node];
+	new_node->move = move;
+	new_node->parent = parent;
+	new_node->first_child = new_node->last_child = NO_VARIANT_NODE;
+	new_node->previous_sibling = new_node->next_sibling = NO_VARIANT_NODE;
+	new_node->solutions = 0;
+
+	if (parent != NO_VARIANT_NODE)
+	{
+		variant_node *parent_node = &trie->nodes[parent];
+		new_node->previous_sibling = parent_node->last_child;
+		if (parent_node->last_child != NO_VARIANT_NODE)
+			trie->nodes[parent_node->last_child].next_sibling = node;
+		else
+			parent_node->first_child = node;
+		parent_node->last_child = node;
+	}
+
+	return node;
 }
 
 
-long
-push_result_forward(bool finish, bool mate, bool draw, bool chessboard, int move_count)
+void
+clear_variants(variant_trie *trie)
 {
-	long result = set_result(finish, mate, draw, chessboard, move_count, move_count, move_count);
-
-	return result;
+	trie->nodes.clear();
+	trie->free_nodes.clear();
 }
 
 
-long
-pull_result_backward(bool mate, bool draw, bool chessboard, int move_count_mate, int move_count_draw, int move_count_chessboard)
+int
+find_variant_child(variant_trie *trie, int node, uint16_t move)
 {
-	long result = set_result(false, mate, draw, chessboard, move_count_mate, move_count_draw, move_count_chessboard);
+	// Variants are added in search order, so the child searched is usually the last one
+	int child = trie->nodes[node].last_child;
 
-	return result;
+	while (child != NO_VARIANT_NODE && trie->nodes[child].move != move)
+		child = trie->nodes[child].previous_sibling;
+
+	return child;
 }
 
 
-void
-push_variant(vector<string> &variant_list, game_state *game)
+int
+find_variant_node(variant_trie *trie, game_state *game)
 {
-	int move_count = (game->side_to_move == WHITE) ? (game->full_move_counter - 1) : game->full_move_counter;
-	char move_list[4000], variant[4000];
-	move_list[0] = 0;
-	get_move_list(move_list, game);
-	output_variant(variant, move_count, move_list, NULL);
-	variant_list.push_back(string(variant));
+	int node = trie->nodes.empty() ? NO_VARIANT_NODE : 0;
+
+	for (int ply = 0; ply < game->ply && node != NO_VARIANT_NODE; ply++)
+		node = find_variant_child(trie, node, pack_move(game_history[ply].move));
+
+	return node;
 }
 
 
-long
-finish_variant(game_state *game, bool print = true, bool mate = false, bool stalemate = false)
+void
+add_variant(variant_trie *trie, uint16_t *moves, int plies, int solutions)
 {
-	bool draw = mate ? false : (stalemate || forced_draw(game));
-	bool chessboard = (goal_chessboard_achieved(game, final_chessboard) && (game->side_to_move == initial_side_to_move));
-	bool max_moves  = ((game->full_move_counter > max_full_move_count)  && (game->side_to_move == initial_side_to_move));
-	bool finish = (mate || draw || chessboard || max_moves);
-	int  move_count = (game->side_to_move == WHITE) ? (game->full_move_counter - 1) : game->full_move_counter;
+	if (trie->nodes.empty())
+		new_variant_node(trie, NO_VARIANT_NODE, 0);
 
-	finish |= ((!goal_is_mate       || game->full_move_counter > min_move_count_mate) &&
-			   (!goal_is_draw       || game->full_move_counter > min_move_count_draw) &&
-			   (!goal_is_chessboard || game->full_move_counter > min_move_count_chessboard));
+	int node = 0;
+	trie->nodes[node].solutions += solutions;
 
-	if (print)
+	for (int ply = 0; ply < plies; ply++)
 	{
-		if (!finish && (verbose >= 3))
-			print_variant(game, verbose);
-		else
-			print_variant(game);
+		int child = find_variant_child(trie, node, moves[ply]);
+		if (child == NO_VARIANT_NODE)
+			child = new_variant_node(trie, node, moves[ply]);
 
-		if (finish)
-		{
-			variants_analyzed++;
-			if (variants_analyzed % 1000000 == 0)
-				print_stats(PERIODIC);
-		}
+		node = child;
+		trie->nodes[node].solutions += solutions;
 	}
+}
 
-	long result = push_result_forward(finish, mate, draw, chessboard, move_count);
 
-	return result;
+void
+push_variant(variant_trie *trie, game_state *game)
+{
+	uint16_t moves[MAX_GAME_PLIES];
+
+	for (int ply = 0; ply < game->ply; ply++)
+		moves[ply] = pack_move(game_history[ply].move);
+
+	add_variant(trie, moves, game->ply, 1);
 }
 
 
-long
-finish_mate_or_stalemate(game_state *game)
+void
+erase_variant_branch(variant_trie *trie, int node)
 {
-	bool mate = false, stalemate = false;
+	variant_node *erased = &trie->nodes[node];
 
-	if (king_in_check(game->chessboard, game->side_to_move))
-		mate = true;
+	if (erased->previous_sibling != NO_VARIANT_NODE)
+		trie->nodes[erased->previous_sibling].next_sibling = erased->next_sibling;
 	else
-		stalemate = true;
+		trie->nodes[erased->parent].first_child = erased->next_sibling;
 
-	if (game->last_move)
-	{
-		game->last_move->mate = mate;
-		game->last_move->draw = stalemate;
-	}
+	if (erased->next_sibling != NO_VARIANT_NODE)
+		trie->nodes[erased->next_sibling].previous_sibling = erased->previous_sibling;
+	else
+		trie->nodes[erased->parent].last_child = erased->previous_sibling;
 
-	long result = finish_variant(game, true, mate, stalemate);
+	for (int parent = erased->parent; parent != NO_VARIANT_NODE; parent = trie->nodes[parent].parent)
+		trie->nodes[parent].solutions -= erased->solutions;
 
-	return result;
+	trie->free_nodes.push_back(node);
 }
 
 
-bool
-is_valid_piece(char piece, int square, int color)
+void
+merge_variant_branch(variant_trie *trie, variant_trie *branch_trie, int node, uint16_t *moves, int plies)
 {
-	if (IS_EMPTY(piece) || (color != COLOR(piece)))
-		return false;
+	int solutions = branch_trie->nodes[node].solutions;
 
-	if ((*special_piece_restriction)(piece, square)) // Problem specifics
-		return false;
+	for (int child = branch_trie->nodes[node].first_child; child != NO_VARIANT_NODE; child = branch_trie->nodes[child].next_sibling)
+	{
+		moves[plies] = branch_trie->nodes[child].move;
+		merge_variant_branch(trie, branch_trie, child, moves, plies + 1);
+		solutions -= branch_trie->nodes[child].solutions;
+	}
+
+	if (solutions > 0) // variants that end at this node
+		add_variant(trie, moves, plies, solutions);
+}
+
+
+void
+merge_variants(variant_trie *trie, variant_trie *branch_trie)
+{
+	uint16_t moves[MAX_GAME_PLIES];
+
+	if (!branch_trie->nodes.empty())
+		merge_variant_branch(trie, branch_trie, 0, moves, 0);
+}
+
+
+int
+get_variant_text(char *variant_text, uint16_t *moves, int plies)
+{
+	// Replayed twice from the initial chessboard: once to unpack the moves, once to write them
+	piece_move variant[MAX_GAME_PLIES];
+	game_state chessboard = variant_root_game;
+	int side_to_move = chessboard.side_to_move;
+	int full_move_counter = chessboard.full_move_counter;
+
+	for (int ply = 0; ply < plies; ply++)
+	{
+		unpack_move(&variant[ply], moves[ply], &chessboard);
+		move_pieces(&chessboard, &variant[ply]);
+		variant[ply].check = king_in_check(&chessboard, (side_to_move == WHITE) ? BLACK : WHITE);
+
+		full_move_counter += (side_to_move == BLACK);
+		side_to_move = (side_to_move == WHITE) ? BLACK : WHITE;
+	}
+
+	char move_list[4000];
+	int move_count = (side_to_move == WHITE) ? (full_move_counter - 1) : full_move_counter;
+	chessboard = variant_root_game;
+	move_list[0] = 0;
+	get_move_list_text(move_list, &chessboard, variant, plies, 1, WHITE);
+	output_variant(variant_text, move_count, move_list, NULL);
+
+	return strlen(variant_text);
+}
+
+
+void
+print_stats(stats_type type)
+{
+	char stats_line[6000], variants_analyzed_str[80], mate_results_str[80], draw_results_str[80], chessboard_results_str[80];
+	char *text = stats_line;
+	int len = 0;
+
+	if (type == TEMPORARY)
+		sprintf(text += len, "\nTemporary results:\n%n", &len);
+	else if (type == FINAL)
+		sprintf(text += len, "\n%n", &len);
+
+	format_commas(variants_analyzed_str, variants_analyzed);
+	sprintf(text += len, "Variants analyzed: %s   %n", variants_analyzed_str, &len);
+
+	if (goal_is_mate)
+	{
+		format_commas(mate_results_str, variant_count(&mate_variant));
+		sprintf(text += len, "Mate solutions: %s   %n", mate_results_str, &len);
+		if (variant_count(&mate_variant) > 0)
+			sprintf(text += len, "Move count%s: %d   %n", move_count_upper_bound ? " upper bound" : "", min_move_count_mate, &len);
+	}
+
+	if (goal_is_draw)
+	{
+		format_commas(draw_results_str, variant_count(&draw_variant));
+		sprintf(text += len, "Draw solutions: %s   %n", draw_results_str, &len);
+		if (variant_count(&draw_variant) > 0)
+			sprintf(text += len, "Move count%s: %d   %n", move_count_upper_bound ? " upper bound" : "", min_move_count_draw, &len);
+	}
+
+	if (goal_is_chessboard)
+	{
+		format_commas(chessboard_results_str, variant_count(&chessboard_variant));
+		sprintf(text += len, "Chessboard solutions: %s   %n", chessboard_results_str, &len);
+		if (variant_count(&chessboard_variant) > 0)
+			sprintf(text += len, "Move count: %d   %n", min_move_count_chessboard, &len);
+	}
+
+	if (transposition_table && (type == TEMPORARY || type == FINAL))
+	{
+		char hits_str[80], misses_str[80], overwrites_str[80];
+		format_commas(hits_str, transposition_hits);
+		format_commas(misses_str, transposition_misses);
+		format_commas(overwrites_str, transposition_overwrites);
+		sprintf(text += len, "Transpositions: hits %s  misses %s  overwrites %s   %n", hits_str, misses_str, overwrites_str, &len);
+	}
+
+	if (type == TEMPORARY || type == FINAL)
+	{
+		char allocations_str[80];
+		format_commas(allocations_str, heap_allocations);
+		sprintf(text += len, "Heap allocations: %s   %n", allocations_str, &len);
+	}
+
+	if ((type == PERIODIC || type == TEMPORARY) && current_game)
+	{
+		char move_list[4000];
+		move_list[0] = 0;
+		get_move_list(move_list, current_game);
+		sprintf(text += len, "Last variant: %s   %n", move_list, &len);
+	}
+
+	if (type == FINAL && save_results_name && (variant_count(&mate_variant) + variant_count(&draw_variant) + variant_count(&chessboard_variant)) > 0)
+		sprintf(text += len, "(See %s)%n", save_results_name, &len);
+
+	sprintf(text += len, "\n%n", &len);
+
+	if (type == TEMPORARY || type == FINAL)
+		sprintf(text += len, "\n%n", &len);
+
+	printf("%s", stats_line);
+
+	if (type == FINAL && save_results_name)
+	{
+		save_results = fopen(save_results_name, "a");
+		fprintf(save_results, "%s", stats_line);
+		fclose(save_results);
+	}
+}
+
+
+void
+print_variant(game_state *game, char const *highlight = NULL)
+{
+	char move_list[4000], print_line[4000];
+	int move_count = (game->side_to_move == WHITE) ? (game->full_move_counter - 1) : game->full_move_counter;
+
+	move_list[0] = 0;
+	get_move_list(move_list, game);
+	output_variant(print_line, move_count, move_list, highlight);
+	if (thread_output)
+		thread_output->append(print_line).append("\n");
+	else
+		printf("%s\n", print_line);
+}
+
+
+long
+set_result(bool finish, bool mate, bool draw, bool chessboard, int move_count_mate, int move_count_draw, int move_count_chessboard)
+{
+	long result = SET_FINISH(finish) | SET_MATE(mate) | SET_DRAW(draw) | SET_CHESSBOARD(chessboard);
+
+	if (mate)
+		result |= SET_MOVE_COUNT_MATE((long) move_count_mate);
+
+	if (draw)
+		result |= SET_MOVE_COUNT_DRAW((long) move_count_draw);
+
+	if (chessboard)
+		result |= SET_MOVE_COUNT_CHESSBOARD((long) move_count_chessboard);
+
+	return result;
+}
+
+
+long
+push_result_forward(bool finish, bool mate, bool draw, bool chessboard, int move_count)
+{
+	long result = set_result(finish, mate, draw, chessboard, move_count, move_count, move_count);
+
+	return result;
+}
+
+
+long
+pull_result_backward(bool mate, bool draw, bool chessboard, int move_count_mate, int move_count_draw, int move_count_chessboard)
+{
+	long result = set_result(false, mate, draw, chessboard, move_count_mate, move_count_draw, move_count_chessboard);
+
+	return result;
+}
+
+
+template <class goal>
+long
+finish_variant(game_state *game, bool print = true, bool mate = false, bool stalemate = false)
+{
+	bool draw = mate ? false : (stalemate || forced_draw(game));
+	bool chessboard = (goal::chessboard && goal_chessboard_achieved(game, final_chessboard) && (game->side_to_move == initial_side_to_move));
+	bool max_moves  = ((game->full_move_counter > max_full_move_count)  && (game->side_to_move == initial_side_to_move));
+	bool finish = (mate || draw || chessboard || max_moves);
+	int  move_count = (game->side_to_move == WHITE) ? (game->full_move_counter - 1) : game->full_move_counter;
+
+	finish |= ((!goal::mate       || game->full_move_counter > min_move_count_mate) &&
+			   (!goal::draw       || game->full_move_counter > min_move_count_draw) &&
+			   (!goal::chessboard || game->full_move_counter > min_move_count_chessboard ||
+									 final_chessboard_infeasible(game) || final_chessboard_unreachable(game) ||
+									 chessboard_plies_lower_bound(game) > remaining_plies(game)));
+
+	if (print)
+	{
+		if (!finish && (verbose >= 3))
+			print_variant(game);
+
+		if (finish)
+		{
+			variants_analyzed++;
+			if (variants_analyzed % 1000000 == 0 && !thread_output)
+				print_stats(PERIODIC);
+		}
+	}
+
+	long result = push_result_forward(finish, mate, draw, chessboard, move_count);
+
+	return result;
+}
+
+
+template <class goal>
+long
+finish_mate_or_stalemate(game_state *game)
+{
+	bool mate = false, stalemate = false;
+
+	if (king_in_check(game, game->side_to_move))
+		mate = true;
+	else
+		stalemate = true;
+
+	if (last_move(game))
+	{
+		last_move(game)->mate = mate;
+		last_move(game)->draw = stalemate;
+	}
+
+	long result = finish_variant<goal>(game, true, mate, stalemate);
+
+	return result;
+}
+
+
+template <class restriction>
+bool
+is_valid_piece(char piece, int square, int color)
+{
+	if (IS_EMPTY(piece) || (color != COLOR(piece)))
+		return false;
+
+	if (restriction::piece(piece, square)) // Problem specifics
+		return false;
+
+	return true;
+}
+
+
+template <class restriction>
+bool
+is_valid_move(piece_move *move)
+{
+	// Legal moves never leave the own king in check, so only the problem specifics remain to be tested
+	if (restriction::move(move)) // Problem specifics
+		return false;
+
+	return true;
+}
+
+
+bool
+material_is_reachable(game_state *game)
+{
+	// Captures only take pieces away and promotions only turn pawns into pieces
+	for (int color = WHITE; color <= BLACK; color++)
+	{
+		char const *pieces = (color == WHITE) ? WHITE_PIECES : BLACK_PIECES;
+		int pawns = POPCOUNT(game->piece_bitboard[BITBOARD_INDEX(pieces[0])]);
+		int promoted_pawns = 0;
+
+		for (int i = 1; i <= 4; i++) // knights, bishops, rooks and queens beyond the initial ones
+			promoted_pawns += extra(POPCOUNT(game->piece_bitboard[BITBOARD_INDEX(pieces[i])]),
+									POPCOUNT(initial_game.piece_bitboard[BITBOARD_INDEX(pieces[i])]));
+
+		if (POPCOUNT(game->color_bitboard[color]) > POPCOUNT(initial_game.color_bitboard[color]) ||
+			(pawns + promoted_pawns) > POPCOUNT(initial_game.piece_bitboard[BITBOARD_INDEX(pieces[0])]))
+			return false;
+	}
+
+	return true;
+}
+
+
+void
+set_retro_game_state(game_state *game, retro_position *position)
+{
+	set_game_state(game, position->chessboard, position->side_to_move);
+
+	game->key ^= state_key(game);
+	game->white_castling_short_ability = false;
+	game->white_castling_long_ability  = false;
+	game->black_castling_short_ability = false;
+	game->black_castling_long_ability  = false;
+	game->key ^= state_key(game);
+}
+
+
+template <class restriction>
+void
+add_retro_position(vector<retro_position> &retro_positions, game_state *game, piece_move *move, char captured_piece,
+				   int captured_square, int plies)
+{
+	// Take the move back, putting back the captured piece, if any
+	game_state prior = *game;
+	int color = COLOR(move->moving_piece);
+
+	move->capture = IS_PIECE(captured_piece);
+	if (!is_valid_piece<restriction>(move->moving_piece, move->from_square, color) || !is_valid_move<restriction>(move)) // Problem specifics
+		return;
+
+	prior.key ^= state_key(&prior);
+	prior.side_to_move = color;
+	prior.key ^= state_key(&prior);
+
+	remove_piece(&prior, move->to_square);
+	put_piece(&prior, move->from_square, move->moving_piece);
+	if (move->capture)
+		put_piece(&prior, captured_square, captured_piece);
+
+	if (IS_KING(move->moving_piece) && FILE(move->from_square) == 'e' && abs(move->to_square - move->from_square) == 2) // Castling
+	{
+		char rook = (color == WHITE) ? WHITE_ROOK : BLACK_ROOK;
+		bool short_castling = (FILE(move->to_square) == 'g');
+
+		remove_piece(&prior, short_castling ? (move->from_square + 1) : (move->from_square - 1));
+		put_piece(&prior, short_castling ? (move->from_square + 3) : (move->from_square - 4), rook);
+	}
+
+	// Before the move, the king of the other player cannot be in check
+	char king = (color == WHITE) ? BLACK_KING : WHITE_KING;
+	int king_square = LSB(prior.piece_bitboard[BITBOARD_INDEX(king)]);
+	if ((attackers_to(&prior, king_square, prior.occupied_bitboard) & prior.color_bitboard[color]) || !material_is_reachable(&prior))
+		return;
+
+	if (!retro_distance.insert(make_pair(placement_key(&prior), plies)).second)
+		return; // already reached with fewer plies
+
+	retro_position position;
+	memcpy(position.chessboard, prior.chessboard, NUM_SQUARES);
+	position.side_to_move = color;
+	retro_positions.push_back(position);
+}
+
+
+template <class restriction>
+void
+add_retro_captures(vector<retro_position> &retro_positions, game_state *game, piece_move *move, bool capture_only, int plies)
+{
+	// The move may have captured any piece of the other player but the king, and pawns are never on the first or last rank
+	char const *pieces = (COLOR(move->moving_piece) == WHITE) ? BLACK_PIECES : WHITE_PIECES;
+
+	if (!capture_only)
+		add_retro_position<restriction>(retro_positions, game, move, EMPTY, NO_SQUARE, plies);
+
+	for (int i = 0; i < 5; i++)
+		if (!IS_PAWN(pieces[i]) || !(BIT(move->to_square) & (RANK_8_BITBOARD | RANK_1_BITBOARD)))
+			add_retro_position<restriction>(retro_positions, game, move, pieces[i], move->to_square, plies);
+}
+
+
+template <class restriction>
+void
+get_retro_positions(vector<retro_position> &retro_positions, game_state *game, int plies)
+{
+	// Un-moves of the player who made the last move, with uncaptures, unpromotions and castling taken back
+	int color = (game->side_to_move == WHITE) ? BLACK : WHITE;
+	int back = (color == WHITE) ? NUM_FILES : -NUM_FILES; // square step to the previous rank of a pawn
+	char pawn = (color == WHITE) ? WHITE_PAWN : BLACK_PAWN;
+	char other_pawn = (color == WHITE) ? BLACK_PAWN : WHITE_PAWN;
+	uint64_t first_rank = (color == WHITE) ? RANK_1_BITBOARD : RANK_8_BITBOARD;
+	uint64_t last_rank  = (color == WHITE) ? RANK_8_BITBOARD : RANK_1_BITBOARD;
+	uint64_t empty = ~game->occupied_bitboard;
+	uint64_t pieces = game->color_bitboard[color];
+	piece_move move;
+
+	while (pieces)
+	{
+		int square = LSB(pieces);
+		pieces &= pieces - 1;
+
+		char piece = game->chessboard[square];
+		bool promoted = !IS_PAWN(piece) && !IS_KING(piece) && (BIT(square) & last_rank);
+
+		if (!IS_PAWN(piece))
+		{
+			uint64_t from_squares = piece_attacks(piece, square, game->occupied_bitboard) & empty;
+			while (from_squares)
+			{
+				default_move(&move, piece, LSB(from_squares));
+				move.to_square = square;
+				add_retro_captures<restriction>(retro_positions, game, &move, false, plies);
+				from_squares &= from_squares - 1;
+			}
+		}
+
+		if (IS_KING(piece) && (BIT(square) & first_rank) && (FILE(square) == 'g' || FILE(square) == 'c'))
+		{
+			bool short_castling = (FILE(square) == 'g');
+			char rook = (color == WHITE) ? WHITE_ROOK : BLACK_ROOK;
+			int king_square = short_castling ? (square - 2) : (square + 2);
+			int rook_square = short_castling ? (king_square + 3) : (king_square - 4);
+			uint64_t vacated = BIT(king_square) | BIT(rook_square) | (short_castling ? 0 : BIT(rook_square + 1));
+
+			if (game->chessboard[short_castling ? (square - 1) : (square + 1)] == rook && (vacated & empty) == vacated)
+			{
+				default_move(&move, piece, king_square);
+				move.to_square = square;
+				add_retro_position<restriction>(retro_positions, game, &move, EMPTY, NO_SQUARE, plies);
+			}
+		}
+
+		if (IS_PAWN(piece) || promoted)
+		{
+			int from_square = square + back;
+			if ((BIT(from_square) & empty) && !(BIT(from_square) & first_rank))
+			{
+				default_move(&move, pawn, from_square);
+				move.to_square = square;
+				move.promoted_piece = promoted ? piece : EMPTY;
+				add_retro_position<restriction>(retro_positions, game, &move, EMPTY, NO_SQUARE, plies);
+
+				from_square += back; // first move of the pawn
+				if (!promoted && RANK(square) == ((color == WHITE) ? '4' : '5') && (BIT(from_square) & empty))
+				{
+					default_move(&move, pawn, from_square);
+					move.to_square = square;
+					add_retro_position<restriction>(retro_positions, game, &move, EMPTY, NO_SQUARE, plies);
+				}
+			}
+
+			uint64_t from_squares = pawn_attacks[!color][square] & empty & ~first_rank;
+			while (from_squares)
+			{
+				default_move(&move, pawn, LSB(from_squares));
+				move.to_square = square;
+				move.promoted_piece = promoted ? piece : EMPTY;
+				add_retro_captures<restriction>(retro_positions, game, &move, true, plies);
+
+				// En passant: the captured pawn moved two squares, passing over the target square
+				int captured_square = square + back;
+				if (!promoted && RANK(square) == ((color == WHITE) ? '6' : '3') && (BIT(captured_square) & empty) &&
+					(BIT(square - back) & empty))
+				{
+					move.en_passant = true;
+					add_retro_position<restriction>(retro_positions, game, &move, other_pawn, captured_square, plies);
+				}
+
+				from_squares &= from_squares - 1;
+			}
+		}
+	}
+}
+
+
+template <class restriction>
+void
+retrograde_search()
+{
+	// Backward search from the final chessboard, breadth first, so that every position keeps the fewest plies to the goal
+	vector<retro_position> frontier(1), next_frontier;
+	game_state game;
+
+	memcpy(frontier[0].chessboard, final_chessboard, NUM_SQUARES);
+	frontier[0].side_to_move = initial_side_to_move;
+	set_retro_game_state(&game, &frontier[0]);
+	retro_distance[placement_key(&game)] = 0;
+
+	for (retro_depth = 0; retro_depth < retro_plies && !frontier.empty(); retro_depth++)
+	{
+		next_frontier.clear();
+		for (size_t i = 0; i < frontier.size() && retro_distance.size() <= MAX_RETRO_POSITIONS; i++)
+		{
+			set_retro_game_state(&game, &frontier[i]);
+			get_retro_positions<restriction>(next_frontier, &game, retro_depth + 1);
+		}
+
+		if (retro_distance.size() > MAX_RETRO_POSITIONS) // the last ply is incomplete, its positions never prune
+			break;
+
+		frontier.swap(next_frontier);
+
+		if (verbose)
+		{
+			char positions_str[80];
+			format_commas(positions_str, frontier.size());
+			printf("Backward search: ply %d   Positions: %s\n", retro_depth + 1, positions_str);
+		}
+	}
+}
+
+
+template <class restriction>
+int
+get_valid_move_count(game_state *game, king_safety *safety, int limit)
+{
+	// The count stops once it reaches the limit, a limit of 1 only tells whether there is any valid move
+	piece_move legal_moves[MAX_LEGAL_MOVES];
+
+	int color = game->side_to_move;
+	int valid_moves = 0;
+	uint64_t pieces = restriction::movable(game, color);
+
+	while (pieces && valid_moves < limit)
+	{
+		int square = LSB(pieces);
+		pieces &= pieces - 1;
+
+		char piece = game->chessboard[square];
+		valid_moves += get_legal_moves(legal_moves, game, safety, piece, square, restriction::targets(game, piece, square));
+	}
+
+	return valid_moves;
+}
+
+
+template <class restriction>
+int
+get_cached_valid_move_count(game_state *game, king_safety *safety)
+{
+	// Positions reached again, or whose moves the search already generated, are not counted again
+	valid_move_count_entry *entry = &valid_move_count_cache[game->key & (VALID_MOVE_CACHE_SIZE - 1)];
+
+	if (entry->key != game->key)
+	{
+		entry->key = game->key;
+		entry->count = get_valid_move_count<restriction>(game, safety, MAX_POSITION_MOVES);
+	}
+
+	return entry->count;
+}
+
+
+void
+store_valid_move_count(game_state *game, int count)
+{
+	valid_move_count_entry *entry = &valid_move_count_cache[game->key & (VALID_MOVE_CACHE_SIZE - 1)];
+	entry->key = game->key;
+	entry->count = count;
+}
+
+
+valid_move_list *
+get_ply_move_list(int ply)
+{
+	while ((int) ply_move_lists.size() <= ply)
+		ply_move_lists.push_back(new valid_move_list);
+
+	return ply_move_lists[ply];
+}
+
+
+template <class goal, class restriction>
+void
+get_valid_moves(valid_move_list *valid_moves, game_state *game)
+{
+	piece_move next_move, legal_moves[MAX_LEGAL_MOVES];
+	king_safety safety, next_safety;
+	get_king_safety(game, &safety);
+
+	int color = game->side_to_move;
+	uint64_t pieces = restriction::movable(game, color);
+	bool count_replies = (goal::mate && color == initial_side_to_move); // the fewest replies lead to a forced mate soonest
+	long result;
+	valid_moves->count = 0;
+
+	while (pieces)
+	{
+		int square = LSB(pieces);
+		pieces &= pieces - 1;
+
+		char piece = game->chessboard[square];
+		int legal_move_count = get_legal_moves(legal_moves, game, &safety, piece, square, restriction::targets(game, piece, square));
+
+		for (int i = 0; i < legal_move_count; i++)
+		{
+			next_move = legal_moves[i];
+
+			make_move(game, &next_move);
+			get_king_safety(game, &next_safety);
+			next_move.check = (next_safety.checkers != 0);
+
+			// Only the replies of a check, or of a move of the mating side, are counted to order the moves.
+			// Other moves are only tested for any reply
+			if (next_move.check || count_replies)
+				next_move.next_valid_moves = get_cached_valid_move_count<restriction>(game, &next_safety);
+			else
+				next_move.next_valid_moves = get_valid_move_count<restriction>(game, &next_safety, 1) ? UNKNOWN_VALID_MOVES : 0;
+
+			if (next_move.next_valid_moves == 0)
+			{
+				next_move.mate =  next_move.check;
+				next_move.draw = !next_move.check;  // Stalemate
+			}
+			else
+			{
+				result = finish_variant<goal>(game, false);
+				next_move.draw = DRAW(result);
+				if (FINISH(result))
+					next_move.next_valid_moves = 0;
+			}
+			unmake_move(game);
+			valid_moves->moves[valid_moves->count++] = next_move;
+		}
+	}
+
+	store_valid_move_count(game, valid_moves->count);
+}
+
+
+void
+print_variant_branch(variant_trie *results, int node, uint16_t *moves, int plies, stats_type type)
+{
+	// Variants in the order they were found, the text of each is only made here
+	int solutions = results->nodes[node].solutions;
+
+	for (int child = results->nodes[node].first_child; child != NO_VARIANT_NODE; child = results->nodes[child].next_sibling)
+	{
+		moves[plies] = results->nodes[child].move;
+		print_variant_branch(results, child, moves, plies + 1, type);
+		solutions -= results->nodes[child].solutions;
+	}
+
+	if (solutions > 0)
+	{
+		char variant_text[4000];
+		get_variant_text(variant_text, moves, plies);
+
+		for (int i = 0; i < solutions; i++)
+		{
+			printf("%s%s%s\n", FG_BOLD_CYAN, variant_text, FG_DEFAULT);
+			if (type == FINAL && save_results_name)
+				fprintf(save_results, "%s\n", variant_text);
+		}
+	}
+}
+
+
+void
+print_results(variant_trie *results, bool goal, char const *title, stats_type type)
+{
+	if (goal && variant_count(results) > 0)
+	{
+		printf("\n%s results:\n\n", title);
+
+		if (type == FINAL && save_results_name)
+		{
+			save_results = fopen(save_results_name, "a");
+			fprintf(save_results, "\n%s results:\n\n", title);
+		}
+
+		vector<uint16_t> moves(MAX_GAME_PLIES);
+		print_variant_branch(results, 0, moves.data(), 0, type);
+
+		if (type == FINAL && save_results_name)
+			fclose(save_results);
+	}
+}
+
+
+void
+erase_bad_variants(variant_trie *variant, bool goal, bool candidate, game_state *game, piece_move *move,
+				   size_t game_variants, size_t previous_variants,
+				   int *min_move_count, int previous_min_move_count, int move_count, bool finish)
+{
+	if (goal)
+	{
+		if (candidate && (previous_min_move_count > move_count))
+		{	// This move forces a shorter variant than the moves searched before it, thus erase their variants. The move may
+			// finish here or deeper, so that the result does not depend on the order of the moves
+			*min_move_count = move_count;
+			if (previous_variants > game_variants)
+			{
+				int node = find_variant_node(variant, game);
+				int keep = find_variant_child(variant, node, pack_move(move));
+				int child = variant->nodes[node].first_child;
+
+				while (child != NO_VARIANT_NODE)
+				{
+					int next_child = variant->nodes[child].next_sibling;
+					if (child != keep)
+						erase_variant_branch(variant, child);
+					child = next_child;
+				}
+			}
+		}
+
+		if (!finish && !candidate)
+		{	// This is a bad variant, thus erase its whole branch
+			*min_move_count = previous_min_move_count;
+			if (variant_count(variant) > previous_variants)
+			{
+				int node = find_variant_node(variant, game);
+				erase_variant_branch(variant, find_variant_child(variant, node, pack_move(move)));
+			}
+		}
+	}
+}
+
+
+move_stage
+get_move_stage(piece_move *move)
+{
+	if (move->next_valid_moves == 0)
+		return STAGE_FINISH;
+
+	if (move->check)
+		return STAGE_CHECK;
+
+	if (move->capture || IS_PIECE(move->promoted_piece))
+		return STAGE_FORCING;
+
+	return STAGE_QUIET;
+}
+
+
+bool
+order_by_move_stage(piece_move move_1, piece_move move_2)
+{
+	// Finishing moves, then checks with the fewest replies first, then captures and promotions, then the other moves.
+	// Moves whose replies are all counted (see get_valid_moves) go by the fewest replies first
+	move_stage stage_1 = get_move_stage(&move_1), stage_2 = get_move_stage(&move_2);
+	bool counted = (move_1.next_valid_moves != UNKNOWN_VALID_MOVES && move_2.next_valid_moves != UNKNOWN_VALID_MOVES);
+	bool order = counted ? (move_1.next_valid_moves < move_2.next_valid_moves ||
+							(move_1.next_valid_moves == move_2.next_valid_moves && stage_1 < stage_2)) :
+						   (stage_1 < stage_2 || (stage_1 == stage_2 && move_1.next_valid_moves < move_2.next_valid_moves));
+
+    return order;
+}
+
+
+void
+init_transposition_table()
+{
+	if (transposition_table_gib <= 0.0)
+		return;
+
+	if (goal_is_draw) // Forced draws depend on the whole game history (repetitions, 50 moves), not only on the position
+	{
+		if (verbose)
+			printf("\nTransposition table is not used in the search for forced draw\n");
+		return;
+	}
+
+	uint64_t entries = 1;
+	while ((entries * 2 * sizeof(transposition_entry)) <= (transposition_table_gib * (1ULL << 30)))
+		entries *= 2;
+
+	transposition_table = (transposition_entry *) calloc(entries, sizeof(transposition_entry));
+	if (transposition_table == NULL)
+	{
+		fprintf(stderr, "Could not allocate %.2f GiB for the transposition table\n\n", transposition_table_gib);
+		exit(14);
+	}
+	transposition_table_mask = entries - 1;
+}
+
+
+template <class goal>
+int
+remaining_moves(game_state *game)
+{
+	// Full moves still allowed below this position before finish_variant cuts the variant
+	int limit = 0;
+
+	if (goal::mate)
+		limit = max(limit, min_move_count_mate);
+	if (goal::draw)
+		limit = max(limit, min_move_count_draw);
+	if (goal::chessboard)
+		limit = max(limit, min_move_count_chessboard);
+
+	return (min(limit, max_full_move_count) - game->full_move_counter);
+}
+
+
+template <class goal>
+bool
+probe_transposition_table(game_state *game, long *result)
+{
+	if (transposition_table == NULL)
+		return false;
+
+	transposition_entry *entry = &transposition_table[game->key & transposition_table_mask];
+	uint64_t key  = __atomic_load_n(&entry->key,  __ATOMIC_RELAXED); // entries are shared by the search threads without locks
+	uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+	int remaining = (int) (uint32_t) (data >> 32);
+	int half_move_clock = (int) (uint32_t) data;
+
+	// A subtree with no solution has no solution either with fewer moves left or closer to the 50 moves rule
+	if ((key ^ data) == game->key && remaining >= remaining_moves<goal>(game) && half_move_clock <= game->half_move_clock)
+	{
+		transposition_hits++;
+		*result = 0;
+		return true;
+	}
+
+	transposition_misses++;
+	return false;
+}
+
+
+template <class goal>
+void
+store_transposition(game_state *game, long result)
+{
+	// Only subtrees without solution are stored: solutions must still be searched to be listed as variants
+	if (transposition_table == NULL || result != 0)
+		return;
+
+	transposition_entry *entry = &transposition_table[game->key & transposition_table_mask];
+	uint64_t key  = __atomic_load_n(&entry->key,  __ATOMIC_RELAXED);
+	uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+
+	if ((key | data) != 0 && (key ^ data) != game->key)
+		transposition_overwrites++;
+
+	data = ((uint64_t) (uint32_t) remaining_moves<goal>(game) << 32) | (uint32_t) game->half_move_clock;
+	__atomic_store_n(&entry->key,  game->key ^ data, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+
+void
+share_min_move_counts()
+{
+	// Bound search: a move count proven by another thread also bounds this subtree
+	min_move_count_mate = min(min_move_count_mate, shared_min_move_count_mate.load(memory_order_relaxed));
+	min_move_count_draw = min(min_move_count_draw, shared_min_move_count_draw.load(memory_order_relaxed));
+	min_move_count_chessboard = min(min_move_count_chessboard, shared_min_move_count_chessboard.load(memory_order_relaxed));
+}
+
+
+void
+publish_min_move_count(atomic<int> &shared_min_move_count, int move_count)
+{
+	int current = shared_min_move_count.load();
+
+	while (move_count < current && !shared_min_move_count.compare_exchange_weak(current, move_count))
+		;
+}
+
+
+template <class goal>
+void
+publish_move_counts(long result, bool root_move)
+{
+	// Any subtree proves a line to the final chessboard, but a forced mate or draw is only proven by a root move,
+	// since deeper the other side may choose another reply
+	if (goal::mate && MATE(result) && root_move)
+		publish_min_move_count(shared_min_move_count_mate, MOVE_COUNT_MATE(result));
+	if (goal::draw && DRAW(result) && root_move)
+		publish_min_move_count(shared_min_move_count_draw, MOVE_COUNT_DRAW(result));
+	if (CHESSBOARD(result))
+		publish_min_move_count(shared_min_move_count_chessboard, MOVE_COUNT_CHESSBOARD(result));
+}
+
+
+template <class goal, class restriction>
+long get_all_valid_moves_from_state(game_state *game);
+
+
+template <class goal, class restriction>
+long
+search_subtree(game_state *game)
+{
+	long result;
+
+	if (!probe_transposition_table<goal>(game, &result))
+	{
+		long previous_repetition_draws = repetition_draws;
+
+		result = get_all_valid_moves_from_state<goal, restriction>(game);
+
+		if (repetition_draws == previous_repetition_draws) // Repetitions depend on the variant, not only on the position
+			store_transposition<goal>(game, result);
+	}
+
+	return result;
+}
+
+
+bool
+same_path(split_task *task, game_state *game)
+{
+	if ((int) task->path.size() != game->ply)
+		return false;
+
+	for (int ply = 0; ply < game->ply; ply++)
+	{
+		piece_move *move = game_history[ply].move;
+		if (task->path[ply].from_square != move->from_square || task->path[ply].to_square != move->to_square ||
+			task->path[ply].promoted_piece != move->promoted_piece)
+			return false;
+	}
+
+	return true;
+}
+
+
+template <class goal, class restriction>
+long
+split_task_result(game_state *game)
+{
+	unique_lock<mutex> lock(split_mutex);
+
+	// The replay reaches the subtrees in the order they were collected, but skips those cut by an earlier result
+	while (split_cursor < split_tasks.size() && !same_path(&split_tasks[split_cursor], game))
+	{
+		if (split_tasks[split_cursor].status == TASK_WAITING)
+			split_tasks[split_cursor].status = TASK_CANCELLED;
+		split_cursor++;
+	}
+
+	if (split_cursor == split_tasks.size())
+	{
+		lock.unlock();
+		return search_subtree<goal, restriction>(game);
+	}
+
+	split_task *task = &split_tasks[split_cursor++];
+
+	// The subtree was searched with the move counts known at the start. If an earlier subtree changed them,
+	// or no thread started it yet, search it here so that the results are the same as in the serial search
+	if (task->status == TASK_WAITING || min_move_count_mate != shared_min_move_count_mate ||
+		min_move_count_draw != shared_min_move_count_draw || min_move_count_chessboard != shared_min_move_count_chessboard)
+	{
+		if (task->status == TASK_WAITING)
+			task->status = TASK_CANCELLED;
+		lock.unlock();
+		return search_subtree<goal, restriction>(game);
+	}
+
+	split_task_done.wait(lock, [task]{ return task->status == TASK_DONE; });
+	lock.unlock();
+
+	long previous_variants_analyzed = variants_analyzed;
+
+	merge_variants(&mate_variant, &task->mate_variant);
+	merge_variants(&draw_variant, &task->draw_variant);
+	if (task->min_move_count_chessboard < min_move_count_chessboard) // the subtree found a shorter variant
+		clear_variants(&chessboard_variant);
+	merge_variants(&chessboard_variant, &task->chessboard_variant);
+	min_move_count_mate = task->min_move_count_mate;
+	min_move_count_draw = task->min_move_count_draw;
+	min_move_count_chessboard = task->min_move_count_chessboard;
+	variants_analyzed += task->variants_analyzed;
+	repetition_draws += task->repetition_draws;
+	transposition_hits += task->transposition_hits;
+	transposition_misses += task->transposition_misses;
+	transposition_overwrites += task->transposition_overwrites;
+	heap_allocations += task->heap_allocations;
+	fputs(task->output.c_str(), stdout);
+
+	last_move(game)->mate = task->path.back().mate; // set if the subtree root has no valid moves
+	last_move(game)->draw = task->path.back().draw;
+
+	if (variants_analyzed / 1000000 != previous_variants_analyzed / 1000000)
+		print_stats(PERIODIC);
+
+	long result = task->result;
+	clear_variants(&task->mate_variant);
+	clear_variants(&task->draw_variant);
+	clear_variants(&task->chessboard_variant);
+	task->output.clear();
+
+	return result;
+}
+
+
+search_frame *
+get_search_frame(int ply)
+{
+	while ((int) search_frames.size() <= ply)
+		search_frames.push_back(new search_frame);
+
+	return search_frames[ply];
+}
+
+
+template <class goal, class restriction>
+search_frame *
+open_search_frame(game_state *game)
+{
+	search_frame *frame = get_search_frame(game->ply);
+
+	if (split_bound_search)
+		share_min_move_counts();
+
+	frame->color = game->side_to_move;
+	frame->move_index = 0;
+	frame->game_mate_candidate = frame->game_draw_candidate = frame->game_chessboard_candidate = false;
+	frame->game_mate_variants = variant_count(&mate_variant);
+	frame->game_draw_variants = variant_count(&draw_variant);
+	frame->previous_repetition_draws = repetition_draws;
+	frame->valid_moves = get_ply_move_list(game->ply);
+	get_valid_moves<goal, restriction>(frame->valid_moves, game);
+	sort(frame->valid_moves->moves, frame->valid_moves->moves + frame->valid_moves->count, order_by_move_stage);
+
+	return frame;
+}
+
+
+template <class goal, class restriction>
+bool
+search_next_move(search_frame *frame, game_state *game, long *result)
+{
+	// Returns true if the move needs a frame of its own, otherwise its result is known
+	frame->next_move = frame->valid_moves->moves[frame->move_index++];
+	make_move(game, &frame->next_move);
+
+	frame->previous_mate_variants = variant_count(&mate_variant);
+	frame->previous_draw_variants = variant_count(&draw_variant);
+	frame->previous_min_move_count_mate = min_move_count_mate;
+	frame->previous_min_move_count_draw = min_move_count_draw;
+
+	*result = finish_variant<goal>(game, true, frame->next_move.mate, frame->next_move.draw);
+	if (FINISH(*result))
+		return false;
+
+	if (game->ply == split_ply)
+	{
+		*result = split_task_result<goal, restriction>(game);
+		return false;
+	}
+
+	return !probe_transposition_table<goal>(game, result);
+}
+
+
+template <class goal, class restriction>
+bool
+end_move(search_frame *frame, game_state *game, long result)
+{
+	// Returns true if the search of the frame is interrupted by this move
+	bool mate_candidate, draw_candidate, chessboard_candidate;
+	piece_move *next_move = &frame->next_move;
+	int color = frame->color;
+
+	frame->game_mate_candidate |= mate_candidate = (goal::mate && MATE(result) && ((color == initial_side_to_move) || !FINISH(result)));
+	frame->game_draw_candidate |= draw_candidate = (goal::draw && DRAW(result));
+	frame->game_chessboard_candidate |= chessboard_candidate = CHESSBOARD(result); // the goal is always reached by the other side
+
+	if (FINISH(result))
+	{
+		bool candidate = (mate_candidate || draw_candidate || chessboard_candidate);
+		char const *highlight = candidate ? FG_BOLD_LIGHT_RED : NULL;
+
+		if (mate_candidate)
+			push_variant(&mate_variant, game);
+
+		if (draw_candidate)
+			push_variant(&draw_variant, game);
+
+		if (chessboard_candidate)
+		{
+			if ((int) MOVE_COUNT_CHESSBOARD(result) < min_move_count_chessboard)
+			{	// This is a shorter variant, thus erase all longer ones found so far
+				min_move_count_chessboard = MOVE_COUNT_CHESSBOARD(result);
+				clear_variants(&chessboard_variant);
+			}
+			push_variant(&chessboard_variant, game);
+		}
+
+		if ((candidate && verbose >= 1) || (verbose >= 2))
+			print_variant(game, highlight);
+	}
+
+	unmake_move(game);
+
+	if (color == initial_side_to_move)
+	{
+		erase_bad_variants(&mate_variant, goal::mate, mate_candidate, game, next_move, frame->game_mate_variants, frame->previous_mate_variants,
+						   &min_move_count_mate, frame->previous_min_move_count_mate, MOVE_COUNT_MATE(result), FINISH(result));
+
+		erase_bad_variants(&draw_variant, goal::draw, draw_candidate, game, next_move, frame->game_draw_variants, frame->previous_draw_variants,
+						   &min_move_count_draw, frame->previous_min_move_count_draw, MOVE_COUNT_DRAW(result), FINISH(result));
+
+	}
+	else if (!mate_candidate && !draw_candidate && !goal::chessboard)
+		return true; // Interrupt branch search if there is any variant that leads to a non-goal finish
+
+	return false;
+}
+
+
+bool
+write_checkpoint_data(FILE *file, void const *data, size_t size)
+{
+	bool written = (fwrite(data, size, 1, file) == 1);
+
+	return written;
+}
+
+
+bool
+read_checkpoint_data(FILE *file, void *data, size_t size)
+{
+	bool read = (fread(data, size, 1, file) == 1);
+
+	return read;
+}
+
+
+bool
+write_checkpoint_identity(FILE *file)
+{
+	// The checkpoint may only be resumed by the same search
+	uint64_t key = variant_root_game.key;
+	char goals[3] = {goal_is_mate, goal_is_draw, goal_is_chessboard};
+	bool written = write_checkpoint_data(file, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) &&
+				   write_checkpoint_data(file, &key, sizeof(key)) &&
+				   write_checkpoint_data(file, goals, sizeof(goals)) &&
+				   write_checkpoint_data(file, &max_full_move_count, sizeof(max_full_move_count)) &&
+				   write_checkpoint_data(file, final_chessboard, sizeof(final_chessboard)) &&
+				   write_checkpoint_data(file, &problem_restrictions, sizeof(problem_restrictions)) &&
+				   (!problem_restrictions || write_checkpoint_data(file, &rules, sizeof(rules)));
+
+	return written;
+}
+
+
+bool
+read_checkpoint_identity(FILE *file)
+{
+	char magic[sizeof(CHECKPOINT_MAGIC)] = {0}, goals[3], chessboard[NUM_SQUARES];
+	bool restrictions;
+	uint64_t key;
+	int move_count;
+
+	bool same_search = read_checkpoint_data(file, magic, strlen(CHECKPOINT_MAGIC)) && strcmp(magic, CHECKPOINT_MAGIC) == 0 &&
+					   read_checkpoint_data(file, &key, sizeof(key)) && key == variant_root_game.key &&
+					   read_checkpoint_data(file, goals, sizeof(goals)) &&
+					   goals[0] == goal_is_mate && goals[1] == goal_is_draw && goals[2] == goal_is_chessboard &&
+					   read_checkpoint_data(file, &move_count, sizeof(move_count)) && move_count == max_full_move_count &&
+					   read_checkpoint_data(file, chessboard, sizeof(chessboard)) && memcmp(chessboard, final_chessboard, sizeof(chessboard)) == 0 &&
+					   read_checkpoint_data(file, &restrictions, sizeof(restrictions)) && restrictions == problem_restrictions;
+
+	if (same_search && problem_restrictions)
+	{
+		problem_rules *file_rules = new problem_rules;
+		same_search = read_checkpoint_data(file, file_rules, sizeof(*file_rules)) && memcmp(file_rules, &rules, sizeof(rules)) == 0;
+		delete file_rules;
+	}
+
+	return same_search;
+}
+
+
+bool
+write_variant_branch(FILE *file, variant_trie *trie, int node)
+{
+	// Preorder: move, variants that end at the node and number of children, then the children
+	uint16_t move = trie->nodes.empty() ? 0 : trie->nodes[node].move;
+	int solutions = trie->nodes.empty() ? 0 : trie->nodes[node].solutions;
+	int children = 0;
+
+	for (int child = trie->nodes.empty() ? NO_VARIANT_NODE : trie->nodes[node].first_child; child != NO_VARIANT_NODE; child = trie->nodes[child].next_sibling)
+	{
+		solutions -= trie->nodes[child].solutions;
+		children++;
+	}
+
+	bool written = write_checkpoint_data(file, &move, sizeof(move)) &&
+				   write_checkpoint_data(file, &solutions, sizeof(solutions)) &&
+				   write_checkpoint_data(file, &children, sizeof(children));
+
+	for (int child = children ? trie->nodes[node].first_child : NO_VARIANT_NODE; written && child != NO_VARIANT_NODE; child = trie->nodes[child].next_sibling)
+		written = write_variant_branch(file, trie, child);
+
+	return written;
+}
+
+
+bool
+read_variant_branch(FILE *file, variant_trie *trie, uint16_t *moves, int plies)
+{
+	uint16_t move;
+	int solutions, children;
+
+	if (!read_checkpoint_data(file, &move, sizeof(move)) || !read_checkpoint_data(file, &solutions, sizeof(solutions)) ||
+		!read_checkpoint_data(file, &children, sizeof(children)) || plies >= MAX_GAME_PLIES || solutions < 0 || children < 0)
+		return false;
+
+	if (plies > 0)
+		moves[plies - 1] = move;
+
+	if (solutions > 0)
+		add_variant(trie, moves, plies, solutions);
+
+	for (int i = 0; i < children; i++)
+		if (!read_variant_branch(file, trie, moves, plies + 1))
+			return false;
+
+	return true;
+}
+
+
+void
+save_checkpoint(game_state *game)
+{
+	// Written to a temporary file that replaces the checkpoint once complete, so that a crash leaves the previous one
+	char temp_name[2000];
+	sprintf(temp_name, "%s.tmp", checkpoint_name);
+
+	FILE *file = fopen(temp_name, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Checkpoint not saved, cannot create %s\n", temp_name);
+		return;
+	}
+
+	int frames = game->ply + 1;
+	bool written = write_checkpoint_identity(file) &&
+				   write_checkpoint_data(file, &variants_analyzed, sizeof(variants_analyzed)) &&
+				   write_checkpoint_data(file, &repetition_draws, sizeof(repetition_draws)) &&
+				   write_checkpoint_data(file, &min_move_count_mate, sizeof(min_move_count_mate)) &&
+				   write_checkpoint_data(file, &min_move_count_draw, sizeof(min_move_count_draw)) &&
+				   write_checkpoint_data(file, &min_move_count_chessboard, sizeof(min_move_count_chessboard)) &&
+				   write_checkpoint_data(file, &frames, sizeof(frames));
+
+	for (int ply = 0; written && ply < frames; ply++)
+	{	// Each frame with its valid moves in search order, the moves before move_index are searched or being searched
+		search_frame *frame = get_search_frame(ply);
+		valid_move_list *valid_moves = frame->valid_moves;
+		written = write_checkpoint_data(file, frame, sizeof(search_frame)) &&
+				  write_checkpoint_data(file, &valid_moves->count, sizeof(valid_moves->count)) &&
+				  write_checkpoint_data(file, valid_moves->moves, valid_moves->count * sizeof(piece_move));
+	}
+
+	written = written && write_variant_branch(file, &mate_variant, 0) && write_variant_branch(file, &draw_variant, 0) &&
+			  write_variant_branch(file, &chessboard_variant, 0);
+	written = written && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	written = (fclose(file) == 0) && written;
+
+	if (written && rename(temp_name, checkpoint_name) == 0)
+	{
+		if (verbose)
+			printf("Checkpoint saved: %s\n", checkpoint_name);
+	}
+	else
+	{
+		fprintf(stderr, "Checkpoint not saved, cannot write %s\n", temp_name);
+		remove(temp_name);
+	}
+}
+
+
+bool
+load_checkpoint()
+{
+	FILE *file = fopen(resume_name, "rb");
+	if (!file)
+		return false;
+
+	int frames = 0;
+	bool read = read_checkpoint_identity(file) &&
+				read_checkpoint_data(file, &variants_analyzed, sizeof(variants_analyzed)) &&
+				read_checkpoint_data(file, &repetition_draws, sizeof(repetition_draws)) &&
+				read_checkpoint_data(file, &min_move_count_mate, sizeof(min_move_count_mate)) &&
+				read_checkpoint_data(file, &min_move_count_draw, sizeof(min_move_count_draw)) &&
+				read_checkpoint_data(file, &min_move_count_chessboard, sizeof(min_move_count_chessboard)) &&
+				read_checkpoint_data(file, &frames, sizeof(frames)) && frames > 0 && frames < MAX_GAME_PLIES;
+
+	if (read)
+	{
+		resume_frames.resize(frames);
+		resume_move_lists.resize(frames);
+	}
+
+	for (int ply = 0; read && ply < frames; ply++)
+	{
+		search_frame *frame = &resume_frames[ply];
+		valid_move_list *valid_moves = &resume_move_lists[ply];
+		read = read_checkpoint_data(file, frame, sizeof(search_frame)) &&
+			   read_checkpoint_data(file, &valid_moves->count, sizeof(valid_moves->count)) &&
+			   valid_moves->count >= 0 && valid_moves->count <= MAX_POSITION_MOVES &&
+			   frame->move_index >= (ply < frames - 1) && frame->move_index <= valid_moves->count &&
+			   read_checkpoint_data(file, valid_moves->moves, valid_moves->count * sizeof(piece_move));
+	}
+
+	vector<uint16_t> moves(MAX_GAME_PLIES);
+	read = read && read_variant_branch(file, &mate_variant, moves.data(), 0) && read_variant_branch(file, &draw_variant, moves.data(), 0) &&
+		   read_variant_branch(file, &chessboard_variant, moves.data(), 0);
+
+	fclose(file);
+	next_checkpoint_variants = variants_analyzed + CHECKPOINT_VARIANTS;
+
+	return read;
+}
+
+
+search_frame *
+resume_search_frames(game_state *game)
+{
+	// The frames of the checkpoint are replayed on the initial chessboard, with the moves being searched made again
+	search_frame *frame = NULL;
+
+	for (size_t ply = 0; ply < resume_frames.size(); ply++)
+	{
+		valid_move_list *valid_moves = get_ply_move_list(game->ply);
+		*valid_moves = resume_move_lists[ply];
+
+		frame = get_search_frame(game->ply);
+		*frame = resume_frames[ply];
+		frame->valid_moves = valid_moves;
+
+		if (ply < resume_frames.size() - 1)
+		{
+			frame->next_move = valid_moves->moves[frame->move_index - 1];
+			make_move(game, &frame->next_move);
+		}
+	}
+
+	resume_frames.clear();
+	resume_move_lists.clear();
+
+	return frame;
+}
+
+
+template <class goal, class restriction>
+long
+get_all_valid_moves_from_state(game_state *game)
+{
+	// Depth-first search until each variant reaches an end, with one frame per ply instead of recursion
+	int root_ply = game->ply;
+	search_frame *frame = resume_frames.empty() ? open_search_frame<goal, restriction>(game) : resume_search_frames(game);
+	long result;
+
+	while (true)
+	{
+		if (checkpoint_name && variants_analyzed >= next_checkpoint_variants)
+		{
+			save_checkpoint(game);
+			next_checkpoint_variants = variants_analyzed + CHECKPOINT_VARIANTS;
+		}
+
+		if (frame->move_index < frame->valid_moves->count)
+		{
+			if (search_next_move<goal, restriction>(frame, game, &result))
+			{
+				frame = open_search_frame<goal, restriction>(game);
+				continue;
+			}
+
+			if (!end_move<goal, restriction>(frame, game, result))
+				continue;
+
+			result = 0;
+		}
+		else if (frame->valid_moves->count == 0)
+			result = finish_mate_or_stalemate<goal>(game);
+		else
+			result = pull_result_backward(frame->game_mate_candidate, frame->game_draw_candidate, frame->game_chessboard_candidate,
+										  min_move_count_mate, min_move_count_draw, min_move_count_chessboard);
+
+		// The frame is done: its result goes to the move of the frame below, until one has moves left
+		bool frame_done = true;
+		while (frame_done)
+		{
+			if (game->ply == root_ply)
+				return result;
+
+			if (repetition_draws == frame->previous_repetition_draws) // Repetitions depend on the variant, not only on the position
+				store_transposition<goal>(game, result);
+
+			frame = get_search_frame(game->ply - 1);
+			frame_done = end_move<goal, restriction>(frame, game, result);
+			if (frame_done)
+				result = 0;
+		}
+	}
+}
+
+
+template <class goal, class restriction>
+void
+collect_split_tasks(game_state *game, piece_move *path)
+{
+	// Same move order and finish test as get_all_valid_moves_from_state, down to the split ply
+	valid_move_list *valid_moves = get_ply_move_list(game->ply);
+	get_valid_moves<goal, restriction>(valid_moves, game);
+	sort(valid_moves->moves, valid_moves->moves + valid_moves->count, order_by_move_stage);
+
+	for (int i = 0; i < valid_moves->count; i++)
+	{
+		path[game->ply] = valid_moves->moves[i];
+		make_move(game, &path[game->ply]);
+
+		long result = finish_variant<goal>(game, false, path[game->ply - 1].mate, path[game->ply - 1].draw);
+		if (!FINISH(result))
+		{
+			if (game->ply < split_ply)
+				collect_split_tasks<goal, restriction>(game, path);
+			else
+			{
+				split_tasks.push_back(split_task());
+				split_tasks.back().path.assign(path, path + game->ply);
+				split_tasks.back().status = TASK_WAITING;
+			}
+		}
+
+		unmake_move(game);
+	}
+}
+
+
+template <class goal, class restriction>
+void
+search_split_task(split_task *task)
+{
+	game_state game = split_root;
+	string output;
+
+	for (size_t i = 0; i < task->path.size(); i++)
+		make_move(&game, &task->path[i]);
+
+	clear_variants(&mate_variant);
+	clear_variants(&draw_variant);
+	clear_variants(&chessboard_variant);
+	min_move_count_mate = shared_min_move_count_mate;
+	min_move_count_draw = shared_min_move_count_draw;
+	min_move_count_chessboard = shared_min_move_count_chessboard;
+	variants_analyzed = 0;
+	repetition_draws = 0;
+	transposition_hits = transposition_misses = transposition_overwrites = 0;
+	heap_allocations = 0;
+	thread_output = &output;
+	current_game = &game;
+
+	long result;
+	result = search_subtree<goal, restriction>(&game); // collect_split_tasks only keeps the moves that do not finish
+
+	task->result = result;
+	task->min_move_count_mate = min_move_count_mate;
+	task->min_move_count_draw = min_move_count_draw;
+	task->min_move_count_chessboard = min_move_count_chessboard;
+	swap(task->mate_variant, mate_variant);
+	swap(task->draw_variant, draw_variant);
+	swap(task->chessboard_variant, chessboard_variant);
+	task->output.swap(output);
+	task->variants_analyzed = variants_analyzed;
+	task->repetition_draws = repetition_draws;
+	task->transposition_hits = transposition_hits;
+	task->transposition_misses = transposition_misses;
+	task->transposition_overwrites = transposition_overwrites;
+	task->heap_allocations = heap_allocations;
+
+	if (split_bound_search) // once proven, a move count bounds the search of every other thread
+		publish_move_counts<goal>(result, task->path.size() == 1);
+
+	thread_output = NULL;
+	current_game = NULL;
+}
+
+
+template <class goal, class restriction>
+void
+search_thread(int thread_id, int parent_verbose)
+{
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL); // temporary results are printed by the main thread
+
+	verbose = parent_verbose;
+
+	while (true)
+	{
+		unique_lock<mutex> lock(split_mutex);
+
+		// Take the first subtree of the own queue, or steal the last subtree of the longest queue
+		deque<size_t> *queue = &thread_queue[thread_id];
+		if (queue->empty())
+			for (int i = 0; i < thread_count; i++)
+				if (thread_queue[i].size() > queue->size())
+					queue = &thread_queue[i];
+
+		if (queue->empty())
+			return;
+
+		size_t index;
+		if (queue == &thread_queue[thread_id])
+		{
+			index = queue->front();
+			queue->pop_front();
+		}
+		else
+		{
+			index = queue->back();
+			queue->pop_back();
+		}
+
+		split_task *task = &split_tasks[index];
+		if (task->status != TASK_WAITING)
+			continue;
+		task->status = TASK_RUNNING;
+		lock.unlock();
+
+		search_split_task<goal, restriction>(task);
+
+		lock.lock();
+		task->status = TASK_DONE;
+		split_task_done.notify_all();
+	}
+}
+
+
+template <class goal, class restriction>
+void
+start_search_threads(vector<thread> &threads)
+{
+	thread_queue.assign(thread_count, deque<size_t>());
+	for (size_t i = 0; i < split_tasks.size(); i++) // interleaved, so that the threads work close to the serial order
+		thread_queue[i % thread_count].push_back(i);
+
+	for (int i = 0; i < thread_count; i++)
+		threads.push_back(thread(search_thread<goal, restriction>, i, verbose));
+}
+
+
+template <class goal, class restriction>
+void
+collect_subtree_split_tasks(game_state *game, piece_move *path)
+{
+	// The split ply is chosen by the number of subtrees: several per thread, so that idle threads have something to steal
+	int best_split_ply = 1;
+	size_t best_split_tasks = 0;
+	for (split_ply = 1; split_ply <= MAX_SPLIT_PLY && (int) best_split_tasks < 8 * thread_count; split_ply++)
+	{
+		split_tasks.clear();
+		collect_split_tasks<goal, restriction>(game, path);
+		if (split_tasks.size() <= best_split_tasks)
+			break;
+		best_split_ply = split_ply;
+		best_split_tasks = split_tasks.size();
+	}
+	split_ply = best_split_ply;
+	split_tasks.clear();
+	collect_split_tasks<goal, restriction>(game, path);
+}
+
+
+template <class goal, class restriction>
+void
+parallel_search(game_state *game)
+{
+	vector<thread> threads;
+	piece_move path[MAX_SPLIT_PLY];
+	long previous_repetition_draws = repetition_draws;
+	split_root = *game;
+
+	// With a mate or draw goal, the bound search is split at the root: only a root move proves a forced count, and
+	// deeper subtrees would also search the replies that the serial search cuts once one of them escapes the goal
+	split_ply = 1;
+	if (goal::mate || goal::draw)
+	{
+		split_tasks.clear();
+		collect_split_tasks<goal, restriction>(game, path);
+	}
+	else
+		collect_subtree_split_tasks<goal, restriction>(game, path);
+	if (verbose)
+		printf("\nSearch threads: %d   Split ply: %d   Subtrees: %zu\n", thread_count, split_ply, split_tasks.size());
+
+	// The root moves that finish are not split tasks, but their move counts are proven before the bound search starts
+	valid_move_list *valid_moves = get_ply_move_list(game->ply);
+	for (int i = 0; i < valid_moves->count; i++)
+	{
+		make_move(game, &valid_moves->moves[i]);
+		long result = finish_variant<goal>(game, false, valid_moves->moves[i].mate, valid_moves->moves[i].draw);
+		if (FINISH(result))
+			publish_move_counts<goal>(result, true);
+		unmake_move(game);
+	}
+	int start_move_count_mate = shared_min_move_count_mate;
+	int start_move_count_draw = shared_min_move_count_draw;
+	int start_move_count_chessboard = shared_min_move_count_chessboard;
+
+	// Bound search: the subtrees are searched in parallel and each proven move count tightens every other thread
+	split_bound_search = true;
+	start_search_threads<goal, restriction>(threads);
+	for (int i = 0; i < thread_count; i++)
+		threads[i].join();
+	threads.clear();
+	split_bound_search = false;
+
+	// The results of any search are the variants of the shortest move count proven for each goal: a move that proves
+	// a shorter count erases the variants of the moves searched before it (erase_bad_variants, and end_move for the
+	// chessboard goal). So starting with the proven counts only changes the statistics, not the solutions
+	min_move_count_mate = shared_min_move_count_mate;
+	min_move_count_draw = shared_min_move_count_draw;
+	min_move_count_chessboard = shared_min_move_count_chessboard;
+
+	if (start_move_count_mate != shared_min_move_count_mate || start_move_count_draw != shared_min_move_count_draw ||
+		start_move_count_chessboard != shared_min_move_count_chessboard)
+	{	// A count proven during the bound search changed the bounds of the subtrees already started: search them all
+		// again with the proven counts from the start. Otherwise their results are replayed as they are
+		collect_subtree_split_tasks<goal, restriction>(game, path);
+		if (verbose)
+			printf("\nSearch threads: %d   Split ply: %d   Subtrees: %zu\n", thread_count, split_ply, split_tasks.size());
+		start_search_threads<goal, restriction>(threads);
+	}
+
+	// The serial search takes the results of the subtrees in its own order, as if it had searched them itself
+	repetition_draws = previous_repetition_draws;
+
+	split_cursor = 0;
+	get_all_valid_moves_from_state<goal, restriction>(game);
+
+	unique_lock<mutex> lock(split_mutex);
+	for (size_t i = 0; i < split_tasks.size(); i++)
+		if (split_tasks[i].status == TASK_WAITING)
+			split_tasks[i].status = TASK_CANCELLED;
+	lock.unlock();
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	split_ply = 0;
+}
+
+
+bool
+read_work_units_header(FILE *file, game_state *game)
+{
+	// Split ply, move counts the units are searched with, and initial chessboard, which must be the one of this process
+	char header_fen[200], fen_text[200];
+	int mate, draw, chessboard;
+
+	if (fscanf(file, "Work units: ply %d, move counts %d %d %d, initial chessboard %199[^\n]\n",
+			   &work_units_ply, &mate, &draw, &chessboard, header_fen) != 5)
+		return false;
+
+	get_game_fen(fen_text, game);
+	if (strcmp(fen_text, header_fen) != 0 || work_units_ply < 1 || work_units_ply > MAX_SPLIT_PLY)
+		return false;
+
+	min_move_count_mate = shared_min_move_count_mate = mate;
+	min_move_count_draw = shared_min_move_count_draw = draw;
+	min_move_count_chessboard = shared_min_move_count_chessboard = chessboard;
+
+	return true;
+}
+
+
+void
+get_work_unit_path_text(char *path_text, split_task *task)
+{
+	int len = 0;
+
+	for (size_t ply = 0; ply < task->path.size(); ply++)
+	{
+		if (ply > 0)
+			path_text[len++] = ',';
+		len += get_coordinate_move_text(path_text + len, &task->path[ply]);
+	}
+}
+
+
+template <class goal, class restriction>
+bool
+write_work_units(game_state *game)
+{
+	// One unit per subtree at the split ply: its number, the moves from the initial chessboard, and its position
+	piece_move path[MAX_SPLIT_PLY];
+	char fen_text[200], path_text[MAX_SPLIT_PLY * 6];
+
+	split_ply = work_units_ply;
+	split_tasks.clear();
+	collect_split_tasks<goal, restriction>(game, path);
+	split_ply = 0;
+
+	FILE *file = fopen(work_units_name, "w");
+	if (!file)
+		return false;
+
+	get_game_fen(fen_text, game);
+	fprintf(file, "Work units: ply %d, move counts %d %d %d, initial chessboard %s\n", work_units_ply,
+			min_move_count_mate, min_move_count_draw, min_move_count_chessboard, fen_text);
+
+	for (size_t i = 0; i < split_tasks.size(); i++)
+	{
+		game_state unit_game = *game;
+		for (size_t ply = 0; ply < split_tasks[i].path.size(); ply++)
+			make_move(&unit_game, &split_tasks[i].path[ply]);
+
+		get_work_unit_path_text(path_text, &split_tasks[i]);
+		get_game_fen(fen_text, &unit_game);
+		fprintf(file, "%zu %s %s\n", i, path_text, fen_text);
+	}
+
+	bool written = (fclose(file) == 0);
+	if (written)
+		printf("\nWork units: %zu at ply %d written to %s\n", split_tasks.size(), work_units_ply, work_units_name);
+
+	return written;
+}
+
+
+template <class goal, class restriction>
+bool
+read_work_unit(FILE *file, int unit, split_task *task, game_state *game)
+{
+	// The moves of the unit are matched to the valid moves, so that they carry the same annotations as in the search
+	char line[1000], path_text[MAX_SPLIT_PLY * 6], fen_text[200];
+	piece_move path[MAX_SPLIT_PLY];
+	int number, plies = 0;
+	game_state unit_game = *game;
+
+	while (fgets(line, sizeof(line), file))
+	{
+		if (sscanf(line, "%d %47s %199[^\n]", &number, path_text, fen_text) != 3 || number != unit)
+			continue;
+
+		for (char *move_text = strtok(path_text, ","); move_text && plies < MAX_SPLIT_PLY; move_text = strtok(NULL, ","))
+		{
+			valid_move_list *valid_moves = get_ply_move_list(unit_game.ply);
+			get_valid_moves<goal, restriction>(valid_moves, &unit_game);
+
+			char text[8];
+			int i = 0;
+			while (i < valid_moves->count && (get_coordinate_move_text(text, &valid_moves->moves[i]), strcmp(text, move_text) != 0))
+				i++;
+			if (i == valid_moves->count)
+				return false;
+
+			path[plies] = valid_moves->moves[i];
+			make_move(&unit_game, &path[plies++]);
+		}
+
+		char unit_fen[200];
+		get_game_fen(unit_fen, &unit_game);
+		if (strcmp(unit_fen, fen_text) != 0 || plies != work_units_ply)
+			return false;
+
+		task->path.assign(path, path + plies);
+		return true;
+	}
+
+	return false;
+}
+
+
+void
+get_work_unit_result_name(char *result_name, int unit)
+{
+	sprintf(result_name, "%s.%d", work_units_name, unit);
+}
+
+
+template <class goal, class restriction>
+bool
+search_work_unit(game_state *game)
+{
+	// The unit is searched as a split task of the search threads, and its results are saved for the merge
+	FILE *file = fopen(work_units_name, "r");
+	if (!file)
+		return false;
+
+	split_task task = split_task();
+	bool found = read_work_units_header(file, game) && read_work_unit<goal, restriction>(file, work_unit, &task, game);
+	fclose(file);
+	if (!found)
+		return false;
+
+	split_root = *game;
+	search_split_task<goal, restriction>(&task);
+	fputs(task.output.c_str(), stdout);
+
+	char result_name[2000], temp_name[2100];
+	get_work_unit_result_name(result_name, work_unit);
+	sprintf(temp_name, "%s.tmp", result_name);
+
+	file = fopen(temp_name, "wb");
+	if (!file)
+		return false;
+
+	int output_size = task.output.size();
+	bool written = write_checkpoint_identity(file) &&
+				   write_checkpoint_data(file, &work_unit, sizeof(work_unit)) &&
+				   write_checkpoint_data(file, &task.result, sizeof(task.result)) &&
+				   write_checkpoint_data(file, &task.min_move_count_mate, sizeof(task.min_move_count_mate)) &&
+				   write_checkpoint_data(file, &task.min_move_count_draw, sizeof(task.min_move_count_draw)) &&
+				   write_checkpoint_data(file, &task.min_move_count_chessboard, sizeof(task.min_move_count_chessboard)) &&
+				   write_checkpoint_data(file, &task.variants_analyzed, sizeof(task.variants_analyzed)) &&
+				   write_checkpoint_data(file, &task.repetition_draws, sizeof(task.repetition_draws)) &&
+				   write_checkpoint_data(file, &task.transposition_hits, sizeof(task.transposition_hits)) &&
+				   write_checkpoint_data(file, &task.transposition_misses, sizeof(task.transposition_misses)) &&
+				   write_checkpoint_data(file, &task.transposition_overwrites, sizeof(task.transposition_overwrites)) &&
+				   write_variant_branch(file, &task.mate_variant, 0) && write_variant_branch(file, &task.draw_variant, 0) &&
+				   write_variant_branch(file, &task.chessboard_variant, 0) &&
+				   write_checkpoint_data(file, &output_size, sizeof(output_size)) &&
+				   (output_size == 0 || write_checkpoint_data(file, task.output.data(), output_size));
+	written = (fclose(file) == 0) && written && rename(temp_name, result_name) == 0;
+
+	if (written)
+	{
+		char variants_analyzed_str[80];
+		format_commas(variants_analyzed_str, task.variants_analyzed);
+		printf("\nWork unit %d: Variants analyzed: %s   (See %s)\n", work_unit, variants_analyzed_str, result_name);
+	}
+
+	return written;
+}
+
+
+bool
+read_work_unit_result(split_task *task, int unit)
+{
+	char result_name[2000];
+	get_work_unit_result_name(result_name, unit);
+
+	FILE *file = fopen(result_name, "rb");
+	if (!file)
+		return false;
+
+	int file_unit, output_size = 0;
+	vector<uint16_t> moves(MAX_GAME_PLIES);
+	bool read = read_checkpoint_identity(file) &&
+				read_checkpoint_data(file, &file_unit, sizeof(file_unit)) && file_unit == unit &&
+				read_checkpoint_data(file, &task->result, sizeof(task->result)) &&
+				read_checkpoint_data(file, &task->min_move_count_mate, sizeof(task->min_move_count_mate)) &&
+				read_checkpoint_data(file, &task->min_move_count_draw, sizeof(task->min_move_count_draw)) &&
+				read_checkpoint_data(file, &task->min_move_count_chessboard, sizeof(task->min_move_count_chessboard)) &&
+				read_checkpoint_data(file, &task->variants_analyzed, sizeof(task->variants_analyzed)) &&
+				read_checkpoint_data(file, &task->repetition_draws, sizeof(task->repetition_draws)) &&
+				read_checkpoint_data(file, &task->transposition_hits, sizeof(task->transposition_hits)) &&
+				read_checkpoint_data(file, &task->transposition_misses, sizeof(task->transposition_misses)) &&
+				read_checkpoint_data(file, &task->transposition_overwrites, sizeof(task->transposition_overwrites)) &&
+				read_variant_branch(file, &task->mate_variant, moves.data(), 0) &&
+				read_variant_branch(file, &task->draw_variant, moves.data(), 0) &&
+				read_variant_branch(file, &task->chessboard_variant, moves.data(), 0) &&
+				read_checkpoint_data(file, &output_size, sizeof(output_size)) && output_size >= 0;
+
+	if (read && output_size > 0)
+	{
+		task->output.resize(output_size);
+		read = read_checkpoint_data(file, &task->output[0], output_size);
+	}
+
+	fclose(file);
+	return read;
+}
+
+
+template <class goal, class restriction>
+bool
+merge_work_unit_results(game_state *game)
+{
+	// The serial search runs down to the split ply and takes the result of each unit there, as with the search threads
+	FILE *file = fopen(work_units_name, "r");
+	if (!file)
+		return false;
+
+	bool read = read_work_units_header(file, game);
+	fclose(file);
+	if (!read)
+		return false;
+
+	piece_move path[MAX_SPLIT_PLY];
+	split_ply = work_units_ply;
+	split_tasks.clear();
+	collect_split_tasks<goal, restriction>(game, path);
+
+	int missing = 0;
+	for (size_t i = 0; i < split_tasks.size(); i++)
+	{
+		split_tasks[i].status = TASK_DONE;
+		if (!read_work_unit_result(&split_tasks[i], i))
+		{
+			fprintf(stderr, "Work unit %zu has no valid result\n", i);
+			missing++;
+		}
+	}
+
+	if (missing == 0)
+	{
+		if (verbose)
+			printf("\nWork units: %zu at ply %d merged from %s\n", split_tasks.size(), split_ply, work_units_name);
+
+		split_cursor = 0;
+		get_all_valid_moves_from_state<goal, restriction>(game);
+	}
+
+	split_ply = 0;
+	return (missing == 0);
+}
+
+
+int
+new_pn_node(int parent, piece_move *move)
+{
+	// Returns NO_PN_NODE once the store is full
+	int node;
+
+	if (!pn_free_nodes.empty())
+	{	// The branch below a reused node is freed in turn
+		node = pn_free_nodes.back();
+		pn_free_nodes.pop_back();
+		for (int child = pn_nodes[node].first_child; child != NO_PN_NODE; child = pn_nodes[child].next_sibling)
+			pn_free_nodes.push_back(child);
+	}
+	else if (pn_used < pn_capacity)
+		node = pn_used++;
+	else
+		return NO_PN_NODE;
+
+	pn_node *new_node = &pn_nodes[node];
+	if (move)
+		new_node->move = *move;
+	new_node->parent = parent;
+	new_node->first_child = NO_PN_NODE;
+	new_node->next_sibling = (parent != NO_PN_NODE) ? pn_nodes[parent].first_child : NO_PN_NODE;
+	new_node->proof = new_node->disproof = 1;
+	new_node->distance = 0;
+
+	if (parent != NO_PN_NODE)
+		pn_nodes[parent].first_child = node;
+
+	return node;
+}
+
+
+void
+free_pn_children(int node, int keep = NO_PN_NODE)
+{
+	// Solved nodes only keep the child of their main line, if any
+	for (int child = pn_nodes[node].first_child; child != NO_PN_NODE; child = pn_nodes[child].next_sibling)
+		if (child != keep)
+			pn_free_nodes.push_back(child);
+
+	pn_nodes[node].first_child = keep;
+	if (keep != NO_PN_NODE)
+		pn_nodes[keep].next_sibling = NO_PN_NODE;
+}
+
+
+void
+update_pn_node(int node, bool or_node)
+{
+	// The side to move chooses among the moves at an OR node, the other side at an AND node
+	uint32_t proof = or_node ? PN_INFINITY : 0, disproof = or_node ? 0 : PN_INFINITY;
+	int main_line = NO_PN_NODE;
+
+	for (int child = pn_nodes[node].first_child; child != NO_PN_NODE; child = pn_nodes[child].next_sibling)
+	{
+		pn_node *child_node = &pn_nodes[child];
+
+		if (or_node)
+		{
+			proof = min(proof, child_node->proof);
+			disproof = min(PN_INFINITY, disproof + child_node->disproof);
+			if (child_node->proof == 0 && (main_line == NO_PN_NODE || child_node->distance < pn_nodes[main_line].distance))
+				main_line = child; // the shortest proof
+		}
+		else
+		{
+			proof = min(PN_INFINITY, proof + child_node->proof);
+			disproof = min(disproof, child_node->disproof);
+			if (main_line == NO_PN_NODE || child_node->distance > pn_nodes[main_line].distance)
+				main_line = child; // the longest defense
+		}
+	}
+
+	pn_nodes[node].proof = proof;
+	pn_nodes[node].disproof = disproof;
+
+	if (proof == 0)
+	{
+		pn_nodes[node].distance = (main_line != NO_PN_NODE) ? (pn_nodes[main_line].distance + 1) : 0;
+		free_pn_children(node, main_line);
+	}
+	else if (disproof == 0)
+		free_pn_children(node);
+}
+
+
+template <class goal, class restriction>
+bool
+expand_pn_node(game_state *game, int node)
+{
+	// Returns false if the store is full. The moves that finish the variant are solved at once, the others start with
+	// the number of replies of the other side (mobility), so that moves leaving few replies are looked at first
+	valid_move_list *valid_moves = get_ply_move_list(game->ply);
+	get_valid_moves<goal, restriction>(valid_moves, game);
+	bool or_node = (game->side_to_move == initial_side_to_move);
+
+	for (int i = 0; i < valid_moves->count; i++)
+	{
+		piece_move *move = &valid_moves->moves[i];
+		int child = new_pn_node(node, move);
+		if (child == NO_PN_NODE)
+		{
+			free_pn_children(node);
+			return false;
+		}
+
+		pn_node *child_node = &pn_nodes[child];
+		make_move(game, &child_node->move);
+
+		long result = finish_variant<goal>(game, true, move->mate, move->draw);
+		if (FINISH(result))
+		{
+			bool proven = goal::mate ? (MATE(result) && or_node) : DRAW(result);
+			child_node->proof = proven ? 0 : PN_INFINITY;
+			child_node->disproof = proven ? PN_INFINITY : 0;
+		}
+		else
+		{
+			king_safety safety;
+			get_king_safety(game, &safety);
+			uint32_t replies = max(1, get_cached_valid_move_count<restriction>(game, &safety));
+			child_node->proof = or_node ? replies : 1;
+			child_node->disproof = or_node ? 1 : replies;
+		}
+
+		unmake_move(game);
+	}
+
+	return true;
+}
+
+
+template <class goal, class restriction>
+int
+prove_goal(game_state *game, long *expanded_nodes)
+{
+	// Best-first search of the AND/OR tree of the goal within max_full_move_count: the most-proving leaf is expanded,
+	// then the numbers are backed up. Returns the move count of the main line if proven, 0 if refuted, -1 if the store is full
+	pn_used = 0;
+	pn_free_nodes.clear();
+	int root = new_pn_node(NO_PN_NODE, NULL), root_ply = game->ply;
+	bool store_full = false;
+
+	while (pn_nodes[root].proof != 0 && pn_nodes[root].disproof != 0 && !store_full)
+	{
+		int node = root;
+		while (pn_nodes[node].first_child != NO_PN_NODE)
+		{
+			bool or_node = (game->side_to_move == initial_side_to_move);
+			int best = pn_nodes[node].first_child;
+			for (int child = pn_nodes[best].next_sibling; child != NO_PN_NODE; child = pn_nodes[child].next_sibling)
+				if (or_node ? (pn_nodes[child].proof < pn_nodes[best].proof) : (pn_nodes[child].disproof < pn_nodes[best].disproof))
+					best = child;
+
+			node = best;
+			make_move(game, &pn_nodes[node].move);
+		}
+
+		store_full = !expand_pn_node<goal, restriction>(game, node);
+		(*expanded_nodes)++;
+
+		while (true)
+		{
+			if (!store_full)
+				update_pn_node(node, game->side_to_move == initial_side_to_move);
+			if (node == root)
+				break;
+			unmake_move(game);
+			node = pn_nodes[node].parent;
+		}
+	}
+
+	if (store_full)
+		return -1;
+
+	if (pn_nodes[root].proof != 0)
+		return 0;
+
+	// The main line is kept as the solution variant: shortest proof against the longest defense
+	for (int node = pn_nodes[root].first_child; node != NO_PN_NODE; node = pn_nodes[node].first_child)
+		make_move(game, &pn_nodes[node].move);
+
+	int move_count = (game->side_to_move == WHITE) ? (game->full_move_counter - 1) : game->full_move_counter;
+	variant_trie *variant = goal::mate ? &mate_variant : &draw_variant;
+	clear_variants(variant);
+	push_variant(variant, game);
+	if (verbose >= 1)
+		print_variant(game, FG_BOLD_LIGHT_RED);
+
+	while (game->ply > root_ply)
+		unmake_move(game);
+
+	return move_count;
+}
+
+
+template <class goal, class restriction>
+void
+proof_number_search(game_state *game)
+{
+	// The main line of a proof is not always the shortest one, so the goal is proven again with fewer moves until it
+	// is refuted, which shows that the last move count proven is the minimum
+	pn_capacity = (int) min((double) INT32_MAX, proof_number_gib * (1ULL << 30) / sizeof(pn_node));
+	pn_nodes = (pn_node *) malloc((size_t) pn_capacity * sizeof(pn_node));
+	if (pn_nodes == NULL || pn_capacity == 0)
+	{
+		fprintf(stderr, "Could not allocate %.2f GiB for the proof-number search\n\n", proof_number_gib);
+		exit(14);
+	}
+
+	int previous_max_full_move_count = max_full_move_count, proven_move_count = 0, move_count;
+	long expanded_nodes = 0;
+
+	do
+	{
+		move_count = prove_goal<goal, restriction>(game, &expanded_nodes);
+
+		char const *outcome = (move_count < 0) ? "unknown, the node store is full" : (move_count == 0) ? "refuted" : "proven";
+		char expanded_str[80], used_str[80];
+		format_commas(expanded_str, expanded_nodes);
+		format_commas(used_str, pn_used);
+		printf("\nProof-number search: %s %s   Move limit: %d   Expanded nodes: %s   Store: %s nodes\n",
+			   goal::mate ? "Forced mate" : "Forced draw", outcome, max_full_move_count, expanded_str, used_str);
+
+		if (move_count > 0)
+		{
+			proven_move_count = move_count;
+			max_full_move_count = move_count - 1;
+		}
+	}
+	while (move_count > 1);
+
+	max_full_move_count = previous_max_full_move_count;
+	if (proven_move_count)
+	{
+		if (goal::mate)
+			min_move_count_mate = proven_move_count;
+		else
+			min_move_count_draw = proven_move_count;
+		move_count_upper_bound = (move_count < 0); // the search with fewer moves did not end
+	}
+
+	free(pn_nodes);
+	pn_nodes = NULL;
+	pn_free_nodes.clear();
+}
+
+
+bool
+find_move_text(piece_move *move, game_state *game, valid_move_list *valid_moves, char const *move_text)
+{
+	// The move is matched in the notation of get_move_text, without the check, mate and en passant marks
+	char text[20];
+
+	for (int i = 0; i < valid_moves->count; i++)
+	{
+		piece_move candidate = valid_moves->moves[i];
+		move_disambiguation(&candidate, game);
+		candidate.check = candidate.mate = candidate.draw = candidate.en_passant = false;
+		get_move_text(text, &candidate);
+
+		if (strcmp(text, move_text) == 0)
+		{
+			*move = valid_moves->moves[i];
+			return true;
+		}
+	}
 
-	return true;
+	return false;
 }
 
 
-bool
-is_valid_move(piece_move *move, game_state *game)
+template <class goal, class restriction>
+int
+replay_known_line(game_state *game, char const *line)
 {
-	if ((*special_move_restriction)(move)) // Problem specifics
-		return false;
+	// Returns the move count of the line, 0 if it does not end on the final chessboard, or minus the ply of its first invalid move.
+	// Move numbers, the result and the marks after a move (+ # ! ? e.p.) are skipped
+	game_state chessboard = *game;
+	vector<piece_move> moves(MAX_GAME_PLIES);
+	vector<char> text(line, line + strlen(line) + 1);
+	int plies = 0;
+
+	for (char *token = strtok(text.data(), " \t\r\n"); token; token = strtok(NULL, " \t\r\n"))
+	{
+		if (isdigit(token[0]) && strncmp(token, "0-0", 3) != 0)
+		{	// Move number, possibly joined to the move, or the result of the game
+			char *p = strrchr(token, '.');
+			if (!p)
+				break;
+			token = p + 1;
+			if (!token[0])
+				continue;
+		}
 
-	update_chessboard(game->chessboard, game->previous->chessboard, move);
+		if (strncmp(token, "0-0", 3) == 0) // castling written with zeros
+			for (char *p = token; *p == '0' || *p == '-'; p++)
+				*p = (*p == '0') ? 'O' : '-';
 
-	if (king_in_check(game->chessboard, game->previous->side_to_move)) // Illegal move: Let own king in check
-		return false;
+		char *p = strstr(token, "e.p.");
+		if (p)
+			*p = 0;
+		for (p = token + strlen(token); p > token && strchr("+#!?", p[-1]); p--)
+			p[-1] = 0;
 
-	if (castling_under_attack(game->chessboard, move)) // Illegal move: Castling under attack
-		return false;
+		valid_move_list *valid_moves = get_ply_move_list(chessboard.ply);
+		get_valid_moves<goal, restriction>(valid_moves, &chessboard);
+		if (plies == MAX_GAME_PLIES || !find_move_text(&moves[plies], &chessboard, valid_moves, token))
+			return -(plies + 1);
 
-	return true;
+		make_move(&chessboard, &moves[plies++]);
+	}
+
+	long result = finish_variant<goal>(&chessboard, false);
+
+	return CHESSBOARD(result) ? MOVE_COUNT_CHESSBOARD(result) : 0;
 }
 
 
+template <class goal, class restriction>
 int
-get_valid_move_count(game_state *game)
+probe_chessboard_line(game_state *game, long *nodes)
 {
-	piece_move next_move, legal_moves[MAX_LEGAL_MOVES];
-	game_state next = *game;
-	next.last_move = &next_move;
-	next.side_to_move = game->side_to_move == WHITE ? BLACK : WHITE;
-	next.full_move_counter += game->side_to_move == WHITE ? 0 : 1;
-	next.previous = game;
+	// Depth first, the moves with the lowest bound of plies to the final chessboard first, until a line reaches it
+	// within the bound of finish_variant or the nodes run out. Returns the move count of the line, 0 if none
+	pair<int, int> order[MAX_POSITION_MOVES];
+	valid_move_list *valid_moves = get_ply_move_list(game->ply);
+	get_valid_moves<goal, restriction>(valid_moves, game);
 
-	int color = game->side_to_move;
-	int valid_moves = 0;
+	for (int i = 0; i < valid_moves->count; i++)
+	{
+		make_move(game, &valid_moves->moves[i]);
+		order[i] = make_pair(chessboard_plies_lower_bound(game), i);
+		unmake_move(game);
+	}
+	sort(order, order + valid_moves->count);
 
-	for (int square = 0; square < NUM_SQUARES; square++)
+	for (int i = 0; i < valid_moves->count && *nodes > 0; i++)
 	{
-		char piece = game->chessboard[square];
-		if (is_valid_piece(piece, square, color))
-		{
-			int legal_move_count = get_legal_moves(legal_moves, game, piece, square);
+		piece_move *move = &valid_moves->moves[order[i].second];
+		make_move(game, move);
+		(*nodes)--;
 
-			for (int i = 0; i < legal_move_count; i++)
-			{
-				next_move = legal_moves[i];
-				if (is_valid_move(&next_move, &next))
-					valid_moves++;
-			}
-		}
+		long result = finish_variant<goal>(game, false, move->mate, move->draw);
+		int move_count = CHESSBOARD(result) ? MOVE_COUNT_CHESSBOARD(result) :
+						 FINISH(result) ? 0 : probe_chessboard_line<goal, restriction>(game, nodes);
+		unmake_move(game);
+
+		if (move_count)
+			return move_count;
 	}
 
-	return valid_moves;
+	return 0;
 }
 
 
+template <class goal, class restriction>
 void
-get_valid_moves(vector<piece_move> &valid_moves, game_state *game)
+seed_chessboard_bound(game_state *game)
 {
-	piece_move next_move, legal_moves[MAX_LEGAL_MOVES];
-	int color = game->previous->side_to_move;
-	long result;
-
-	for (int square = 0; square < NUM_SQUARES; square++)
+	// The move count of a known line, or of the shortest line found by the probe, bounds the search before its first
+	// solution, so that finish_variant and remaining_plies prune from the start. The line itself is found again by the search
+	if (known_line)
 	{
-		char piece = game->previous->chessboard[square];
-		if (is_valid_piece(piece, square, color))
+		int move_count = replay_known_line<goal, restriction>(game, known_line);
+		if (move_count < 0)
 		{
-			int legal_move_count = get_legal_moves(legal_moves, game->previous, piece, square);
+			fprintf(stderr, "\nInvalid move at ply %d of the known line (-k)\n\n", -move_count);
+			exit(44);
+		}
+		if (move_count == 0)
+		{
+			fprintf(stderr, "\nThe known line (-k) does not end on the final chessboard\n\n");
+			exit(44);
+		}
 
-			for (int i = 0; i < legal_move_count; i++)
-			{
-				next_move = legal_moves[i];
+		min_move_count_chessboard = min(min_move_count_chessboard, move_count);
+		if (verbose)
+			printf("\nKnown line   Move count: %d\n", move_count);
+	}
 
-				if (is_valid_move(&next_move, game))
-				{
-					move_disambiguation(&next_move, game->previous->chessboard);
-					next_move.check = king_in_check(game->chessboard, game->side_to_move);
-					next_move.next_valid_moves = get_valid_move_count(game);
-					if (next_move.next_valid_moves == 0)
-					{
-						next_move.mate =  next_move.check;
-						next_move.draw = !next_move.check;  // Stalemate
-					}
-					else
-					{
-						result = finish_variant(game, false);
-						next_move.draw = DRAW(result);
-						if (FINISH(result))
-							next_move.next_valid_moves = 0;
-					}
-					valid_moves.push_back(next_move);
-				}
-			}
+	if (probe_nodes)
+	{	// Each line found tightens the bound of the next probe, which only looks for shorter lines
+		long nodes = probe_nodes;
+		int bound = min_move_count_chessboard, found = 0;
+		min_move_count_chessboard = min(bound, MAX_PROBE_MOVES + 1) - 1;
+
+		while (nodes > 0 && min_move_count_chessboard > 0)
+		{
+			int move_count = probe_chessboard_line<goal, restriction>(game, &nodes);
+			if (move_count == 0)
+				break;
+			bound = found = move_count;
+			min_move_count_chessboard = move_count - 1;
+		}
+		min_move_count_chessboard = bound;
+
+		if (verbose)
+		{
+			char nodes_str[80];
+			format_commas(nodes_str, probe_nodes - nodes);
+			if (found)
+				printf("\nProbe   Move count: %d   Nodes: %s\n", found, nodes_str);
+			else
+				printf("\nProbe: no %sline found   Nodes: %s\n", known_line ? "shorter " : "", nodes_str);
 		}
 	}
+
+	shared_min_move_count_chessboard = min_move_count_chessboard;
 }
 
 
-void
-print_results(vector<string> &results, bool goal, char const *title, stats_type type)
+template <class goal, class restriction>
+int
+search_goals(game_state *game)
 {
-	if (goal && results.size() > 0)
+	// Search in the mode of the command line, with the goals and the problem restrictions known at compile time
+	if (goal::chessboard && work_unit < 0 && !merge_work_units && !resume_name) // the work units and the checkpoint keep their bound
+		seed_chessboard_bound<goal, restriction>(game);
+
+	if (work_units_ply && !merge_work_units && work_unit < 0)
+		return write_work_units<goal, restriction>(game) ? 0 : 34;
+
+	if (work_unit >= 0)
 	{
-		printf("\n%s results:\n\n", title);
+		if (search_work_unit<goal, restriction>(game))
+			return 0;
+		fprintf(stderr, "\nWork unit %d not found in %s, or its results not saved\n\n", work_unit, work_units_name);
+		return 34;
+	}
 
-		if (type == FINAL && save_results_name)
+	if (resume_name)
+	{
+		if (!load_checkpoint())
 		{
-			save_results = fopen(save_results_name, "a");
-			fprintf(save_results, "\n%s results:\n\n", title);
+			fprintf(stderr, "\nCheckpoint of another search or invalid: %s\n\n", resume_name);
+			return 27;
 		}
+		printf("\nSearch resumed from %s\n", resume_name);
+	}
 
-		for (int i = 0; i < results.size(); i++)
+	if (proof_number_gib > 0.0)
+		proof_number_search<goal, restriction>(game);
+	else if (merge_work_units)
+	{
+		if (!merge_work_unit_results<goal, restriction>(game))
 		{
-			printf("%s%s%s\n", FG_BOLD_CYAN, results.at(i).c_str(), FG_DEFAULT);
-			if (type == FINAL && save_results_name)
-				fprintf(save_results, "%s\n", results.at(i).c_str());
+			fprintf(stderr, "\nWork units of another search, or not all searched: %s\n\n", work_units_name);
+			return 34;
 		}
+	}
+	else if (thread_count > 1)
+		parallel_search<goal, restriction>(game);
+	else
+		get_all_valid_moves_from_state<goal, restriction>(game);
 
-		if (type == FINAL && save_results_name)
-			fclose(save_results);
+	print_results(&mate_variant, goal::mate, "Mate", FINAL);
+	print_results(&draw_variant, goal::draw, "Draw", FINAL);
+	print_results(&chessboard_variant, goal::chessboard, "Chessboard", FINAL);
+	print_stats(FINAL);
+	return 0;
+}
+
+
+template <class restriction>
+int
+search_restricted(game_state *game)
+{
+	// One instance of the search per combination of goals
+	switch ((goal_is_mate << 2) | (goal_is_draw << 1) | goal_is_chessboard)
+	{
+		case 1:
+			return search_goals<goal_policy<false, false, true>,  restriction>(game);
+		case 2:
+			return search_goals<goal_policy<false, true,  false>, restriction>(game);
+		case 3:
+			return search_goals<goal_policy<false, true,  true>,  restriction>(game);
+		case 4:
+			return search_goals<goal_policy<true,  false, false>, restriction>(game);
+		case 5:
+			return search_goals<goal_policy<true,  false, true>,  restriction>(game);
+		case 6:
+			return search_goals<goal_policy<true,  true,  false>, restriction>(game);
+		default:
+			return search_goals<goal_policy<true,  true,  true>,  restriction>(game);
 	}
 }
 
 
-void
-erase_bad_variants(vector<string> &variant, bool goal, bool candidate, size_t game_variants, size_t previous_variants,
-				   int *min_move_count, int previous_min_move_count, int move_count, bool finish, bool erase_branch = true)
+long
+perft(game_state *game, int depth, bool divide = false)
 {
-	if (goal)
+	if (depth == 0)
+		return 1;
+
+	piece_move legal_moves[MAX_LEGAL_MOVES];
+	king_safety safety;
+	get_king_safety(game, &safety);
+
+	int color = game->side_to_move;
+	uint64_t pieces = game->color_bitboard[color];
+	long nodes = 0;
+
+	while (pieces)
 	{
-		if (finish && candidate && (*min_move_count > move_count))
-		{	// This is a shorter variant, thus erase its siblings
-			*min_move_count = move_count;
-			if (previous_variants > game_variants)
-				variant.erase(variant.begin() + game_variants, variant.begin() + previous_variants);
-		}
+		int square = LSB(pieces);
+		pieces &= pieces - 1;
 
-		if (!finish && !candidate && erase_branch)
-		{	// This is a bad variant, thus erase its whole branch
-			*min_move_count = previous_min_move_count;
-			if (variant.size() > previous_variants)
-				variant.erase(variant.begin() + previous_variants, variant.end());
+		char piece = game->chessboard[square];
+		if (!is_valid_piece<no_restrictions>(piece, square, color)) // perft counts the moves of the rules of chess only
+			continue;
+
+		int legal_move_count = get_legal_moves(legal_moves, game, &safety, piece, square);
+
+		for (int i = 0; i < legal_move_count; i++)
+		{
+			piece_move *move = &legal_moves[i];
+			if (!is_valid_move<no_restrictions>(move))
+				continue;
+
+			long move_nodes = 1; // Bulk counting: the moves of the last ply are counted, not made
+			if (depth > 1)
+			{
+				make_move(game, move);
+				move_nodes = perft(game, depth - 1);
+				unmake_move(game);
+			}
+			nodes += move_nodes;
+
+			if (divide)
+			{
+				char move_text[8];
+				get_coordinate_move_text(move_text, move);
+				printf("%s: %ld\n", move_text, move_nodes);
+			}
 		}
 	}
+
+	return nodes;
 }
 
 
 bool
-order_by_ascending_next_valid_moves(piece_move move_1, piece_move move_2)
+perft_depth_report(game_state *game, int depth, long expected_nodes, bool divide, long *total_nodes, double *total_seconds)
 {
-	bool order = (move_1.next_valid_moves < move_2.next_valid_moves);
-
-    return order;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	long nodes = perft(game, depth, divide);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	bool match = (expected_nodes == 0 || nodes == expected_nodes);
+
+	char nodes_str[80], nps_str[80];
+	format_commas(nodes_str, nodes);
+	format_commas(nps_str, (seconds > 0.0) ? (long) (nodes / seconds) : 0);
+	printf("  Depth %d   Nodes: %s   %s%s%s   Time: %.3f s   Nodes/s: %s\n", depth, nodes_str,
+		   match ? "" : FG_BOLD_LIGHT_RED, (expected_nodes == 0) ? "(unknown)" : (match ? "OK" : "FAIL"),
+		   match ? "" : FG_DEFAULT, seconds, nps_str);
+
+	*total_nodes += nodes;
+	*total_seconds += seconds;
+	return match;
 }
 
 
-long
-get_all_valid_moves_from_state(game_state *game)
+int
+run_perft(int depth)
 {
-	long result;
-	bool game_mate_candidate = false, game_draw_candidate = false, game_chessboard_candidate = false;
-	bool mate_candidate, draw_candidate, chessboard_candidate;
-	size_t game_mate_variants = mate_variant.size();
-	size_t game_draw_variants = draw_variant.size();
-	size_t game_chessboard_variants = chessboard_variant.size();
+	// Move generator check and speed: node counts of every position up to the given depth
+	game_state game;
+	long total_nodes = 0;
+	double total_seconds = 0.0;
+	int failures = 0;
 
-	piece_move next_move;
-	game_state next = *game;
-	next.last_move = &next_move;
-	next.side_to_move = game->side_to_move == WHITE ? BLACK : WHITE;
-	next.full_move_counter += game->side_to_move == WHITE ? 0 : 1;
-	next.previous = game;
+	if (initial_fen[0])
+	{
+		fen_game_state(&game, initial_fen);
+		printf("Perft: %s\n", initial_fen);
+		perft_depth_report(&game, depth, 0, true, &total_nodes, &total_seconds);
+	}
+	else
+	{
+		for (size_t i = 0; i < sizeof(perft_positions) / sizeof(perft_positions[0]); i++)
+		{
+			fen_game_state(&game, perft_positions[i].fen);
+			printf("Perft: %s\n", perft_positions[i].fen);
+			for (int d = 1; d <= depth; d++)
+			{
+				long expected_nodes = (d <= MAX_PERFT_DEPTH) ? perft_positions[i].nodes[d - 1] : 0;
+				if (!perft_depth_report(&game, d, expected_nodes, (verbose >= 2 && d == depth), &total_nodes, &total_seconds))
+					failures++;
+			}
+			printf("\n");
+		}
+	}
 
-	int color = game->side_to_move;
-	vector<piece_move> valid_moves;
-	get_valid_moves(valid_moves, &next);
-	sort(valid_moves.begin(), valid_moves.end(), order_by_ascending_next_valid_moves);
+	char nodes_str[80], nps_str[80];
+	format_commas(nodes_str, total_nodes);
+	format_commas(nps_str, (total_seconds > 0.0) ? (long) (total_nodes / total_seconds) : 0);
+	printf("\nPerft nodes: %s   Time: %.3f s   Nodes/s: %s   Failures: %d\n\n", nodes_str, total_seconds, nps_str, failures);
 
-	for (int i = 0; i < valid_moves.size(); i++)
-	{
-		next_move = valid_moves.at(i);
-		update_chessboard(next.chessboard, game->chessboard, &next_move);
-		update_state(&next);
+	return failures;
+}
 
-		size_t previous_mate_variants = mate_variant.size();
-		size_t previous_draw_variants = draw_variant.size();
-		size_t previous_chessboard_variants = chessboard_variant.size();
-		int previous_min_move_count_mate = min_move_count_mate;
-		int previous_min_move_count_draw = min_move_count_draw;
-		int previous_min_move_count_chessboard = min_move_count_chessboard;
 
-		result = finish_variant(&next, true, next_move.mate, next_move.draw);
-		if (!FINISH(result))
-			result = get_all_valid_moves_from_state(&next); // Go recursively until variant reaches an end
+void
+print_benchmark(char const *name, chrono::steady_clock::time_point start, long calls)
+{
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	char calls_str[80];
+	format_commas(calls_str, calls);
+	printf("  %-24s Calls: %15s   Time: %8.3f s   ns/call: %9.1f\n", name, calls_str, seconds,
+		   (calls > 0) ? seconds * 1e9 / calls : 0.0);
+}
 
-		game_mate_candidate |= mate_candidate = (goal_is_mate && MATE(result) && ((color == initial_side_to_move) || !FINISH(result)));
-		game_draw_candidate |= draw_candidate = (goal_is_draw && DRAW(result));
-		game_chessboard_candidate |= chessboard_candidate = (CHESSBOARD(result) && ((color == initial_side_to_move) || !FINISH(result)));
 
-		if (FINISH(result))
+void
+run_benchmark(long passes)
+{
+	// Time of the primitives of the search, each one in isolation, over all benchmark positions
+	int const num_positions = sizeof(benchmark_positions) / sizeof(benchmark_positions[0]);
+	static game_state games[sizeof(benchmark_positions) / sizeof(benchmark_positions[0])];
+	static piece_move moves[sizeof(benchmark_positions) / sizeof(benchmark_positions[0])][16 * MAX_LEGAL_MOVES]; // up to 16 pieces per side
+	int move_count[sizeof(benchmark_positions) / sizeof(benchmark_positions[0])];
+	king_safety safety[sizeof(benchmark_positions) / sizeof(benchmark_positions[0])];
+	char text[4000];
+	long calls;
+	chrono::steady_clock::time_point start;
+
+	for (int i = 0; i < num_positions; i++)
+	{
+		fen_game_state(&games[i], benchmark_positions[i]);
+		get_king_safety(&games[i], &safety[i]);
+		move_count[i] = 0;
+		for (int square = 0; square < NUM_SQUARES; square++)
 		{
-			bool candidate = (mate_candidate || draw_candidate || chessboard_candidate);
-			char const *highlight = candidate ? FG_BOLD_LIGHT_RED : NULL;
-
-			if (mate_candidate)
-				push_variant(mate_variant, &next);
+			char piece = games[i].chessboard[square];
+			if (IS_PIECE(piece) && COLOR(piece) == games[i].side_to_move)
+				move_count[i] += get_legal_moves(moves[i] + move_count[i], &games[i], &safety[i], piece, square);
+		}
+	}
 
-			if (draw_candidate)
-				push_variant(draw_variant, &next);
+	printf("Benchmark: %d positions, %ld passes\n\n", num_positions, passes);
 
-			if (chessboard_candidate)
-				push_variant(chessboard_variant, &next);
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++, calls++)
+			benchmark_sink += fen_piece_placement(text, benchmark_positions[i]);
+	print_benchmark("fen_piece_placement", start, calls);
 
-			if ((candidate && verbose >= 1) || (verbose >= 2))
-				print_variant(&next, verbose, highlight);
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++)
+		{
+			piece_move legal_moves[MAX_LEGAL_MOVES];
+			king_safety node_safety;
+			get_king_safety(&games[i], &node_safety);
+			for (int square = 0; square < NUM_SQUARES; square++)
+			{
+				char piece = games[i].chessboard[square];
+				if (IS_PIECE(piece) && COLOR(piece) == games[i].side_to_move)
+				{
+					benchmark_sink += get_legal_moves(legal_moves, &games[i], &node_safety, piece, square);
+					calls++;
+				}
+			}
 		}
-
-		if (color == initial_side_to_move)
+	print_benchmark("get_legal_moves", start, calls); // king safety of the node included
+
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++)
+			for (int square = 0; square < NUM_SQUARES; square++, calls += 2)
+				benchmark_sink += square_is_attacked(&games[i], WHITE, square) + square_is_attacked(&games[i], BLACK, square);
+	print_benchmark("square_is_attacked", start, calls);
+
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++, calls += 2)
+			benchmark_sink += king_in_check(&games[i], WHITE) + king_in_check(&games[i], BLACK);
+	print_benchmark("king_in_check", start, calls);
+
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++, calls += 2)
 		{
-			erase_bad_variants(mate_variant, goal_is_mate, mate_candidate, game_mate_variants, previous_mate_variants,
-							   &min_move_count_mate, previous_min_move_count_mate, MOVE_COUNT_MATE(result), FINISH(result));
-
-			erase_bad_variants(draw_variant, goal_is_draw, draw_candidate, game_draw_variants, previous_draw_variants,
-							   &min_move_count_draw, previous_min_move_count_draw, MOVE_COUNT_DRAW(result), FINISH(result));
-
-			erase_bad_variants(chessboard_variant, goal_is_chessboard, chessboard_candidate, game_chessboard_variants, previous_chessboard_variants,
-							   &min_move_count_chessboard, previous_min_move_count_chessboard, MOVE_COUNT_CHESSBOARD(result), FINISH(result), false);
+			int king_square = (games[i].side_to_move == WHITE) ? SQUARE('e','1') : SQUARE('e', ('1' + NUM_RANKS - 1));
+			benchmark_sink += castling_under_attack(&safety[i], king_square, WHITE_KING) +
+							  castling_under_attack(&safety[i], king_square, WHITE_QUEEN);
+		}
+	print_benchmark("castling_under_attack", start, calls);
+
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++, calls++)
+			benchmark_sink += forced_draw(&games[i]);
+	print_benchmark("forced_draw", start, calls);
+
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++)
+			for (int m = 0; m < move_count[i]; m++, calls++)
+				move_disambiguation(&moves[i][m], &games[i]);
+	print_benchmark("move_disambiguation", start, calls);
+
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++)
+		for (int i = 0; i < num_positions; i++)
+			for (int m = 0; m < move_count[i]; m++, calls++)
+				benchmark_sink += get_move_text(text, &moves[i][m]);
+	print_benchmark("get_move_text", start, calls);
+
+	// Move list of a variant made of the first legal move of each position, as long as the game allows
+	game_state game = games[0];
+	piece_move variant[40];
+	while (game.ply < 40)
+	{
+		piece_move legal_moves[MAX_LEGAL_MOVES];
+		king_safety node_safety;
+		get_king_safety(&game, &node_safety);
+		int legal_move_count = 0;
+		for (int square = 0; square < NUM_SQUARES && legal_move_count == 0; square++)
+		{
+			char piece = game.chessboard[square];
+			if (IS_PIECE(piece) && COLOR(piece) == game.side_to_move)
+				legal_move_count = get_legal_moves(legal_moves, &game, &node_safety, piece, square);
 		}
-		else if (!mate_candidate && !draw_candidate && !goal_is_chessboard)
-			return 0; // Interrupt branch search if there is any variant that leads to a non-goal finish
+		if (legal_move_count == 0)
+			break;
+		variant[game.ply] = legal_moves[0];
+		make_move(&game, &variant[game.ply]);
 	}
 
-	if (valid_moves.size() == 0)
-		result = finish_mate_or_stalemate(game);
-	else
-		result = pull_result_backward(game_mate_candidate, game_draw_candidate, game_chessboard_candidate,
-									  min_move_count_mate, min_move_count_draw, min_move_count_chessboard);
-	return result;
+	start = chrono::steady_clock::now(), calls = 0;
+	for (long pass = 0; pass < passes; pass++, calls++)
+		benchmark_sink += get_move_list(text, &game);
+	print_benchmark("get_move_list", start, calls);
+	printf("  (variant of %d plies)\n\n", game.ply);
 }
 
 
@@ -1355,8 +4843,9 @@ signal_handler(int signum)
 {
 	if (signum == SIGQUIT)
 	{
-		print_results(mate_variant, goal_is_mate, "Mate", TEMPORARY);
-		print_results(draw_variant, goal_is_draw, "Draw", TEMPORARY);
+		print_results(&mate_variant, goal_is_mate, "Mate", TEMPORARY);
+		print_results(&draw_variant, goal_is_draw, "Draw", TEMPORARY);
+		print_results(&chessboard_variant, goal_is_chessboard, "Chessboard", TEMPORARY);
 		print_stats(TEMPORARY);
 	}
 	else
@@ -1374,14 +4863,14 @@ secure_file(char const *file_name)
 
 	fclose(file);
 	pid_t pid = getpid();
-	char new_file_name[2000], file_type[80];
-	strcpy(new_file_name, file_name);
-	char *p = strrchr(new_file_name, '.');
+	char base_name[2000], new_file_name[2100], file_type[80];
+	snprintf(base_name, sizeof(base_name), "%s", file_name);
+	char *p = strrchr(base_name, '.');
 	if (p == NULL)
-		p = new_file_name + strlen(new_file_name);
-	strcpy(file_type, p);
+		p = base_name + strlen(base_name);
+	snprintf(file_type, sizeof(file_type), "%s", p);
 	(*p) = 0;
-	sprintf(new_file_name, "%s_%d%s", new_file_name, pid, file_type);
+	snprintf(new_file_name, sizeof(new_file_name), "%s_%d%s", base_name, (int) pid, file_type);
 	rename(file_name, new_file_name);
 }
 
@@ -1399,6 +4888,21 @@ usage(int exit_code = 0, char const *error_msg = "", char const *error_msg2 = ""
 		"    -d             : search for forced draw\n"
 		"    -n <moves>     : maximum number of moves\n"
 		"    -r <file>      : results filename\n"
+		"    -t <GiB>       : transposition table size (no table if not set)\n"
+		"    -g <GiB>       : proof-number search of a forced mate (-m) or draw (-d), with a node store of the given size\n"
+		"    -k <moves>     : known line to the final chessboard, its move count bounds the search (with -f)\n"
+		"    -q <nodes>     : probe for short lines to the final chessboard before the search (with -f)\n"
+		"    -j <threads>   : number of search threads (1 if not set)\n"
+		"    -p <depth>     : perft of the initial chessboard with divide, or of the built-in positions if -i is not set\n"
+		"    -b <passes>    : time of the search primitives over the built-in positions\n"
+		"    -u <plies>     : plies searched backward from the final chessboard to prune the search (with -f)\n"
+		"    -c <file>      : checkpoint file of the search, written periodically\n"
+		"    -s <file>      : resume the search from a checkpoint file\n"
+		"    -e <file>      : rules file of the problem, with frozen pieces, captures and move directions\n"
+		"    -w <file>      : work units file of a search split over several processes, with -x -y or -z\n"
+		"    -x <ply>       : split the search into work units at the given ply\n"
+		"    -y <unit>      : search one work unit, its results are saved next to the work units file\n"
+		"    -z             : merge the results of all the work units\n"
 		"    -v <verbose>   : verbose level\n\n");
 
 	if (exit_code)
@@ -1417,8 +4921,10 @@ read_parameters(int argc, char **argv)
 				usage(1, "Initial chessboard (FEN) expected after -i");
 			i++;
 			initial_fen = argv[i];
-			if (fen_piece_placement(initial_chessboard, argv[i]) != 0)
+			if (fen_game_state(&initial_game, argv[i]) != 0) // the active color and the other fields are optional
 				usage(2, "FEN syntax error after -i: ", argv[i]);
+			memcpy(initial_chessboard, initial_game.chessboard, NUM_SQUARES);
+			initial_side_to_move = initial_game.side_to_move;
 		}
 		else if (strcmp(argv[i], "-f") == 0)
 		{
@@ -1451,6 +4957,133 @@ read_parameters(int argc, char **argv)
 			i++;
 			save_results_name = argv[i];
 		}
+		else if (strcmp(argv[i], "-t") == 0)
+		{
+			if (i == argc - 1)
+				usage(12, "Size in GiB expected after -t");
+			i++;
+			char *p;
+			transposition_table_gib = strtod(argv[i], &p);
+			if (p != argv[i] + strlen(argv[i]) || transposition_table_gib <= 0.0)
+				usage(13, "Invalid size after -t: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-g") == 0)
+		{
+			if (i == argc - 1)
+				usage(37, "Size in GiB expected after -g");
+			i++;
+			char *p;
+			proof_number_gib = strtod(argv[i], &p);
+			if (p != argv[i] + strlen(argv[i]) || proof_number_gib <= 0.0)
+				usage(38, "Invalid size after -g: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-j") == 0)
+		{
+			if (i == argc - 1)
+				usage(15, "Number of threads expected after -j");
+			i++;
+			char *p;
+			thread_count = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || thread_count <= 0)
+				usage(16, "Invalid number of threads after -j: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-k") == 0)
+		{
+			if (i == argc - 1)
+				usage(40, "Moves expected after -k");
+			i++;
+			known_line = argv[i];
+		}
+		else if (strcmp(argv[i], "-q") == 0)
+		{
+			if (i == argc - 1)
+				usage(41, "Number of nodes expected after -q");
+			i++;
+			char *p;
+			probe_nodes = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || probe_nodes <= 0)
+				usage(42, "Invalid number of nodes after -q: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-p") == 0)
+		{
+			if (i == argc - 1)
+				usage(17, "Depth expected after -p");
+			i++;
+			char *p;
+			perft_depth = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || perft_depth <= 0)
+				usage(18, "Invalid depth after -p: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-b") == 0)
+		{
+			if (i == argc - 1)
+				usage(20, "Number of passes expected after -b");
+			i++;
+			char *p;
+			benchmark_passes = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || benchmark_passes <= 0)
+				usage(21, "Invalid number of passes after -b: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-u") == 0)
+		{
+			if (i == argc - 1)
+				usage(22, "Number of plies expected after -u");
+			i++;
+			char *p;
+			retro_plies = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || retro_plies <= 0)
+				usage(23, "Invalid number of plies after -u: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-c") == 0)
+		{
+			if (i == argc - 1)
+				usage(24, "File name expected after -c");
+			i++;
+			checkpoint_name = argv[i];
+		}
+		else if (strcmp(argv[i], "-s") == 0)
+		{
+			if (i == argc - 1)
+				usage(25, "File name expected after -s");
+			i++;
+			resume_name = argv[i];
+		}
+		else if (strcmp(argv[i], "-e") == 0)
+		{
+			if (i == argc - 1)
+				usage(35, "File name expected after -e");
+			i++;
+			rules_name = argv[i];
+		}
+		else if (strcmp(argv[i], "-w") == 0)
+		{
+			if (i == argc - 1)
+				usage(28, "File name expected after -w");
+			i++;
+			work_units_name = argv[i];
+		}
+		else if (strcmp(argv[i], "-x") == 0)
+		{
+			if (i == argc - 1)
+				usage(29, "Ply expected after -x");
+			i++;
+			char *p;
+			work_units_ply = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || work_units_ply <= 0 || work_units_ply > MAX_SPLIT_PLY)
+				usage(30, "Invalid ply after -x: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-y") == 0)
+		{
+			if (i == argc - 1)
+				usage(31, "Work unit expected after -y");
+			i++;
+			char *p;
+			work_unit = strtol(argv[i], &p, 10);
+			if (p != argv[i] + strlen(argv[i]) || work_unit < 0)
+				usage(32, "Invalid work unit after -y: ", argv[i]);
+		}
+		else if (strcmp(argv[i], "-z") == 0)
+			merge_work_units = true;
 		else if (strcmp(argv[i], "-v") == 0)
 		{
 			if (i == argc - 1 || argv[i + 1][0] == '-')
@@ -1468,12 +5101,28 @@ read_parameters(int argc, char **argv)
 			usage(9, "Invalid command line argument: ", argv[i]);
 	}
 
-	if (!(goal_is_mate || goal_is_draw || goal_is_chessboard))
-		usage(10, "At least one search option (-f -m -d) must be set");
+	if (!(goal_is_mate || goal_is_draw || goal_is_chessboard || perft_depth || benchmark_passes))
+		usage(10, "At least one search option (-f -m -d -p -b) must be set");
+
+	if ((checkpoint_name || resume_name) && thread_count > 1)
+		usage(26, "Checkpoints (-c -s) are only made by a single search thread");
+
+	if ((work_units_ply || work_unit >= 0 || merge_work_units) != (work_units_name != NULL))
+		usage(33, "The work units file (-w) is set with one of -x -y -z");
+
+	if (proof_number_gib > 0.0 && ((goal_is_mate == goal_is_draw) || goal_is_chessboard || thread_count > 1 ||
+								   checkpoint_name || resume_name || work_units_name))
+		usage(39, "The proof-number search (-g) proves one goal (-m or -d) in a single search thread");
+
+	if ((known_line || probe_nodes) && !goal_is_chessboard)
+		usage(43, "The known line (-k) and the probe (-q) bound the search for the final chessboard (-f)");
 
 	print_chessboard(initial_chessboard);
 
-	if (king_in_check(initial_chessboard, (initial_side_to_move == WHITE) ? BLACK : WHITE))
+	game_state game = initial_game;
+	if (!initial_fen[0])
+		set_game_state(&game, initial_chessboard, initial_side_to_move);
+	if (king_in_check(&game, (initial_side_to_move == WHITE) ? BLACK : WHITE))
 	{
 		fprintf(stderr, "%s king is in check on initial chessboard: %s\n\n", (initial_side_to_move == WHITE ? "Black" : "White"), initial_fen);
 		exit(11);
@@ -1481,57 +5130,82 @@ read_parameters(int argc, char **argv)
 }
 
 
-bool
-piece_restriction_K_Ra1_Pa(char piece, int square)
-{
-	// Rule #1 for the Kuwait problem: K, Ra1 and Pa never move
-	if ((piece == WHITE_KING) || (piece == WHITE_ROOK && square == SQUARE('a','1')) || (piece == WHITE_PAWN && FILE(square) == 'a'))
-		return true;
-
-	return false;
-}
-
-
-bool
-move_restriction_Pb_Pf_capture(piece_move *move)
-{
-	// Rule #2 for the Kuwait problem: Pb...Pf cannot move ahead and cannot capture pieces to the right side
-	if (move->moving_piece == WHITE_PAWN && FILE(move->from_square) <= 'f' && FILE(move->from_square) <= FILE(move->to_square))
-		return true;
-
-	// Rule #3 for the Kuwait problem: Every other white piece but Pb...Pf cannot capture anything
-	if (COLOR(move->moving_piece) == WHITE && !(move->moving_piece == WHITE_PAWN && FILE(move->from_square) <= 'f') && move->capture)
-		return true;
-
-	return false;
-}
-
-
 int
 main(int argc, char **argv)
 {
 	if (argc == 1 || strcmp(argv[1], "-h") == 0)
 		usage(-1);
 
+	init_attack_tables();
+	init_piece_distances();
+	init_zobrist_keys();
 	fen_piece_placement(initial_chessboard, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR");
+	game_state start_game;
+	set_game_state(&start_game, initial_chessboard);
 	read_parameters(argc, argv);
-	set_game_state(&initial_game, initial_chessboard, initial_side_to_move);
+	if (!initial_fen[0])
+		set_game_state(&initial_game, initial_chessboard, initial_side_to_move);
+
+	if (perft_depth)
+		return run_perft(perft_depth) ? 19 : 0;
+
+	if (benchmark_passes)
+	{
+		run_benchmark(benchmark_passes);
+		return 0;
+	}
+
 	secure_file(save_results_name);
 
-	if (goal_is_chessboard && strcmp(final_fen, "k7/P7/P7/P7/P7/P7/P7/R3K3") == 0) // Kuwait chess problem specifics
+	if (rules_name)
+	{
+		int line_number = read_rules_file(rules_name);
+		if (line_number < 0)
+		{
+			fprintf(stderr, "Could not read the rules file %s\n\n", rules_name);
+			exit(36);
+		}
+		if (line_number > 0)
+		{
+			fprintf(stderr, "Invalid rule at line %d of %s\n\n", line_number, rules_name);
+			exit(36);
+		}
+	}
+
+	// Kuwait chess problem specifics, whose rules and known line only hold from the standard initial chessboard
+	if (goal_is_chessboard && strcmp(final_fen, KUWAIT_FINAL_FEN) == 0 && initial_game.key == start_game.key)
+	{
+		if (!rules_name)
+			compile_rules(&rules, KUWAIT_RULES);
+		if (!known_line)
+			known_line = KUWAIT_KNOWN_LINE;
+	}
+
+	if (goal_is_chessboard)
+	{
+		init_final_chessboard_rules();
+		if (verbose)
+			printf("\nLower bound to final chessboard: %d plies\n", chessboard_plies_lower_bound(&initial_game));
+	}
+
+	if (goal_is_chessboard && retro_plies)
 	{
-		special_piece_restriction = piece_restriction_K_Ra1_Pa;
-		special_move_restriction  = move_restriction_Pb_Pf_capture;
-		max_full_move_count = 34;
+		if (problem_restrictions)
+			retrograde_search<rule_restrictions>();
+		else
+			retrograde_search<no_restrictions>();
 	}
 
+	init_transposition_table();
 	signal(SIGQUIT, signal_handler);
 	printf("\nPress Ctrl+\\ to display temporary results\n");
 
-	get_all_valid_moves_from_state(&initial_game);
+	current_game = &initial_game;
+	variant_root_game = initial_game;
+	heap_allocations = 0;
 
-	print_results(mate_variant, goal_is_mate, "Mate", FINAL);
-	print_results(draw_variant, goal_is_draw, "Draw", FINAL);
-	print_stats(FINAL);
-	return 0;
+	if (problem_restrictions)
+		return search_restricted<rule_restrictions>(&initial_game);
+
+	return search_restricted<no_restrictions>(&initial_game);
 }
@@ -8,6 +8,10 @@
 #ifndef KUWAIT_CHESS_HPP_
 #define KUWAIT_CHESS_HPP_
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 #define NUM_FILES		  8
 #define NUM_RANKS		  8
 #define NUM_SQUARES		 64 // (NUM_FILES * NUM_RANKS)
@@ -19,6 +23,31 @@
 #define NUM_KINGS		  1
 #define MAX_LEGAL_PIECES 16
 #define MAX_LEGAL_MOVES	 27 // Number of legal moves for a queen on a central square of an empty chessboard
+#define MAX_POSITION_MOVES 218 // Most legal moves known in a chess position
+#define MAX_GAME_PLIES	12000 // The longest possible game under the fifty move rule has 5949 moves
+#define MAX_SPLIT_PLY	    8 // Deepest ply where the search is split into subtrees for the search threads
+#define MAX_PERFT_DEPTH	    7 // Deepest known node count of the perft positions
+#define MAX_RETRO_POSITIONS 4000000 // Positions kept by the backward search from the final chessboard
+#define CHECKPOINT_VARIANTS 100000000 // Variants analyzed between two checkpoints of the search
+#define CHECKPOINT_MAGIC	"KCCHECK1"
+#define MAX_RULE_LINE	  200 // Longest line of a rules file
+#define NUM_RULE_DIRECTIONS 8
+#define MAX_PROBE_MOVES	  100 // Longest line looked for by the probe of the final chessboard
+
+// Rules of the Kuwait chess problem: K, Ra1 and Pa never move, Pb...Pf only capture to the left side,
+// and every other white piece cannot capture anything
+#define KUWAIT_FINAL_FEN	"k7/P7/P7/P7/P7/P7/P7/R3K3"
+#define KUWAIT_RULES		"frozen K\n" \
+							"frozen R a1\n" \
+							"frozen P a\n" \
+							"moves P a-f up-left\n" \
+							"no_capture NBRQK\n" \
+							"no_capture P g-h\n"
+#define KUWAIT_KNOWN_LINE	"1. g4 e5 2. Nh3 Ba3 3. bxa3 h5 4. Bb2 hxg4 5. Bc3 Rh4 6. Bd4 exd4 7. Nc3 dxc3 8. dxc3 g3 " \
+							"9. Qd3 Rb4 10. Nf4 g5 11. h4 f5 12. h5 d5 13. h6 Bd7 14. h7 g2 15. h8=B g1=R 16. Bd4 Ba4 " \
+							"17. Rh4 Rg3 18. Bg2 gxf4 19. Be3 fxe3 20. Be4 fxe4 21. fxe3 exd3 22. exd3 c5 23. Rc4 dxc4 " \
+							"24. dxc4 b5 25. cxb4 Qa5 26. cxb5 Na6 27. bxa5 O-O-O 28. bxa6 Rd4 29. exd4 Rb3 30. cxb3 Ne7 " \
+							"31. bxa4 Nd5 32. dxc5 Nb6 33. cxb6 Kb8 34. bxa7 Ka8"
 
 #define WHITE			  0
 #define BLACK			  1
@@ -37,11 +66,16 @@
 #define BLACK_KING		 'k'
 #define WHITE_PIECES	 "PNBRQK"
 #define BLACK_PIECES	 "pnbrqk"
+#define ALL_PIECES		 "PNBRQKpnbrqk" // (WHITE_PIECES BLACK_PIECES) in bitboard index order
+#define NUM_PIECE_TYPES	  6
+#define NUM_BITBOARDS	 12 // (NUM_PIECE_TYPES * 2)
 #define RANK_SEPARATOR	 '/'
 
 #define COLOR(piece)		(islower(piece) != 0)
-#define IS_WHITE(piece)		(strchr(WHITE_PIECES, (piece)) != NULL)
-#define IS_BLACK(piece)		(strchr(BLACK_PIECES, (piece)) != NULL)
+#define IS_WHITE(piece)		((piece) == WHITE_PAWN || (piece) == WHITE_KNIGHT || (piece) == WHITE_BISHOP || \
+							 (piece) == WHITE_ROOK || (piece) == WHITE_QUEEN  || (piece) == WHITE_KING)
+#define IS_BLACK(piece)		((piece) == BLACK_PAWN || (piece) == BLACK_KNIGHT || (piece) == BLACK_BISHOP || \
+							 (piece) == BLACK_ROOK || (piece) == BLACK_QUEEN  || (piece) == BLACK_KING)
 #define IS_PIECE(piece)		(IS_WHITE(piece) || IS_BLACK(piece))
 #define IS_EMPTY(piece)		((piece) == EMPTY)
 #define IS_PAWN(piece)		((piece) == WHITE_PAWN   || (piece) == BLACK_PAWN)
@@ -55,9 +89,26 @@
 #define RANK(square)		('8' - ((square) / NUM_FILES)) // ranks are numbered bottom-up from '1' to '8'
 #define SQUARE(file, rank)	(((file) - 'a') + ('8' - (rank)) * NUM_FILES)
 
+#define BIT(square)			(1ULL << (square)) // bitboard bit order is the same as the square numbering
+#define LSB(bitboard)		__builtin_ctzll(bitboard)
+#define POPCOUNT(bitboard)	__builtin_popcountll(bitboard)
+#define FILE_A_BITBOARD		0x0101010101010101ULL
+#define FILE_H_BITBOARD		0x8080808080808080ULL
+#define RANK_8_BITBOARD		0x00000000000000FFULL
+#define RANK_1_BITBOARD		0xFF00000000000000ULL
+
 #define NO_SQUARE				-1
+#define NO_DISTANCE				99 // moves between squares that a piece can never connect (bishops of another square color)
 #define IS_BLACK_SQUARE(square)	((((square) / NUM_FILES) % 2) ^ (((square) % NUM_FILES) % 2)) // (rank even and file odd)  or (rank odd and file even)
 #define IS_WHITE_SQUARE(square)	!IS_BLACK_SQUARE(square) 				  					  // (rank even and file even) or (rank odd and file odd)
+#define WHITE_SQUARES_BITBOARD	0xAA55AA55AA55AA55ULL
+
+// Material signature: the count of each piece in 4 bits, by bitboard index
+#define MATERIAL_UNIT(index)		(1ULL << (4 * (index)))
+#define MATERIAL_COUNT(material, index)	(((material) >> (4 * (index))) & 0x0F)
+#define MATERIAL_MASK(index)		(0x0FULL << (4 * (index)))
+#define MAJOR_MATERIAL_MASK			(MATERIAL_MASK(0) | MATERIAL_MASK(3) | MATERIAL_MASK(4) | \
+									 MATERIAL_MASK(6) | MATERIAL_MASK(9) | MATERIAL_MASK(10)) // pawns, rooks and queens
 
 #define SET_FINISH(bit)					( bit)
 #define SET_MATE(bit)					((bit) <<  1)
@@ -75,28 +126,123 @@
 #define MOVE_COUNT_DRAW(result)			(((result) & 0xFFFF00000000) >> 32)
 #define MOVE_COUNT_CHESSBOARD(result)	(((result) & 0xFFFF000000000000) >> 48)
 
+#define PROMOTION_PIECES		"NBRQ"
+#define PACKED_FROM(code)		( (code)        & 0x3F)
+#define PACKED_TO(code)			(((code) >>  6) & 0x3F)
+#define PACKED_PROMOTION(code)	(((code) >> 12) & 0x03) // index in PROMOTION_PIECES, if the pawn reaches the last rank
+#define PACKED_MATE(code)		(((code) >> 14) & 0x01)
+#define PACKED_DRAW(code)		(((code) >> 15) & 0x01)
+#define NO_VARIANT_NODE			-1
+
+#define NO_PN_NODE				-1
+#define UNKNOWN_VALID_MOVES		-1 // reply count not computed, the move is ordered by its stage only
+#define VALID_MOVE_CACHE_SIZE	4096 // reply counts kept by each search thread, a power of 2
+#define PN_INFINITY				0x40000000U // proof or disproof number of a solved node, sums saturate to it
+
 enum stats_type {PERIODIC, TEMPORARY, FINAL};
+enum task_status {TASK_WAITING, TASK_RUNNING, TASK_DONE, TASK_CANCELLED};
+enum move_stage {STAGE_FINISH, STAGE_CHECK, STAGE_FORCING, STAGE_QUIET}; // order in which the valid moves are searched
+enum material_type {MATERIAL_PAWNS, MATERIAL_KNIGHTS, MATERIAL_WHITE_SQUARE_BISHOPS, MATERIAL_BLACK_SQUARE_BISHOPS,
+					MATERIAL_ROOKS, MATERIAL_QUEENS, MATERIAL_PIECES, NUM_MATERIAL_TYPES};
+
+template <bool is_mate, bool is_draw, bool is_chessboard>
+struct goal_policy // goals of the search, known at compile time so that the tests of the other goals are dropped
+{
+	static constexpr bool mate = is_mate;
+	static constexpr bool draw = is_draw;
+	static constexpr bool chessboard = is_chessboard;
+};
+
+struct piece_move // 8 bytes: the move in the first word, then its flags and annotations
+{
+	char   moving_piece;
+	char   promoted_piece;
+	int8_t from_square;
+	int8_t to_square;
+	bool   capture		  : 1;
+	bool   en_passant	  : 1;
+	bool   check		  : 1; // annotations, set when the move is validated
+	bool   mate			  : 1;
+	bool   draw			  : 1;
+	bool   file_ambiguity : 1; // set only when the move is printed
+	bool   rank_ambiguity : 1;
+	int16_t next_valid_moves; // replies of a check, 0 if the move finishes the variant, UNKNOWN_VALID_MOVES otherwise
+};
+
+struct valid_move_count_entry // exact reply count of a position, see get_cached_valid_move_count
+{
+	uint64_t key;
+	int count;
+};
+
+struct valid_move_list // valid moves of one ply of the search
+{
+	int count;
+	piece_move moves[MAX_POSITION_MOVES];
+};
+
+struct search_frame // one ply of the search, kept off the call stack
+{
+	piece_move next_move; // move being searched, game_history points to it
+	valid_move_list *valid_moves;
+	int  move_index; // next move of valid_moves
+	int  color;
+	bool game_mate_candidate;
+	bool game_draw_candidate;
+	bool game_chessboard_candidate;
+	size_t game_mate_variants; // solutions when the frame was opened
+	size_t game_draw_variants;
+	size_t previous_mate_variants; // solutions before the move being searched
+	size_t previous_draw_variants;
+	int  previous_min_move_count_mate;
+	int  previous_min_move_count_draw;
+	long previous_repetition_draws; // the position is stored in the transposition table if the frame found no repetition
+};
+
+struct slider_magic
+{
+	uint64_t mask;	  // relevant occupancy (ray squares without the board edges)
+	uint64_t magic;
+	uint64_t *attacks;
+	int shift;
+};
+
+struct king_safety // attack information of the side to move, computed once per node
+{
+	int king_square;
+	uint64_t checkers;
+	uint64_t pinned;	 // own pieces that may only move along the line between the king and the pinner
+	uint64_t check_mask; // target squares that block or capture a single checker (all squares if not in check)
+	uint64_t enemy_attacks; // squares attacked by the opponent, seen through the own king
+};
 
-struct piece_move
+struct transposition_entry // subtree without solution
 {
-	char moving_piece;
-	char promoted_piece;
-	int  from_square;
-	int  to_square;
-	bool file_ambiguity;
-	bool rank_ambiguity;
-	bool capture;
-	bool en_passant;
-	bool check;
-	bool mate;
-	bool draw;
-	int  next_valid_moves;
+	uint64_t key;  // position key xor data, so that an entry torn by two threads writing at once does not match
+	uint64_t data; // full moves that were still allowed below the position (high half) and half move clock (low half)
+};
+
+struct undo_record // state that a move overwrites, kept per ply to take the move back
+{
+	piece_move *move;
+	char captured_piece;
+	int  captured_square;
+	bool white_castling_short_ability;
+	bool white_castling_long_ability;
+	bool black_castling_short_ability;
+	bool black_castling_long_ability;
+	int  en_passant_target_square;
+	int  half_move_clock;
 };
 
 struct game_state
 {
 	char chessboard[NUM_SQUARES]; // squares are numbered from left to right top-down
-	piece_move *last_move;
+	uint64_t piece_bitboard[NUM_BITBOARDS]; // one bitboard per piece, in ALL_PIECES order
+	uint64_t color_bitboard[2];
+	uint64_t occupied_bitboard;
+	uint64_t key; // Zobrist key of chessboard, side to move, castling abilities and en passant file (if a pawn can capture)
+	uint64_t material; // material signature of the chessboard, see MATERIAL_UNIT
 	int  side_to_move; // (next move) 0 = white, 1 = black
 	bool white_castling_short_ability; // K and Rh have never moved and Rh was not captured
 	bool white_castling_long_ability;  // K and Ra have never moved and Ra was not captured
@@ -105,7 +251,74 @@ struct game_state
 	int  en_passant_target_square; // skipped square from the last move of pawn
 	int  half_move_clock; // counter for 50 move draw rule (without capture or pawn move)
 	int  full_move_counter; // (next move)
-	game_state *previous;
+	int  ply; // half moves made since the initial chessboard, index of the next undo record
+};
+
+struct retro_position // position of the backward search, whose castling and en passant abilities are unknown
+{
+	char chessboard[NUM_SQUARES];
+	int  side_to_move;
+};
+
+struct perft_position
+{
+	char const *fen;
+	long nodes[MAX_PERFT_DEPTH]; // known node counts from depth 1, 0 if not known
+};
+
+struct variant_node // move of the stored variants, shared by all the variants that begin with the same moves
+{
+	uint16_t move; // packed move, see PACKED_FROM
+	int  parent;
+	int  first_child;
+	int  last_child;
+	int  previous_sibling;
+	int  next_sibling;
+	int  solutions; // variants that end in the branch
+};
+
+struct variant_trie // variants from the initial chessboard, node 0 is the initial chessboard
+{
+	std::vector<variant_node> nodes;
+	std::vector<int> free_nodes; // erased branches, whose nodes are reused one at a time
+};
+
+struct problem_rules // rules of a composed problem, compiled into masks by piece (bitboard index) and square
+{
+	uint64_t frozen[NUM_BITBOARDS]; // squares where the piece never moves
+	uint64_t move_targets[NUM_BITBOARDS][NUM_SQUARES]; // squares the piece may move to
+	uint64_t capture_targets[NUM_BITBOARDS][NUM_SQUARES]; // squares where the piece may capture
+};
+
+struct pn_node // node of the proof-number search, whose position is reached by the moves from the root
+{
+	piece_move move; // move from the parent node
+	int parent;
+	int first_child;
+	int next_sibling;
+	uint32_t proof;	   // fewest leaves to expand to prove the goal
+	uint32_t disproof; // fewest leaves to expand to refute the goal
+	int distance; // plies from the node to the goal, once proven
+};
+
+struct split_task // subtree searched by a search thread, identified by the moves from the initial chessboard
+{
+	std::vector<piece_move> path;
+	task_status status;
+	long result;
+	int  min_move_count_mate; // as left by the subtree search
+	int  min_move_count_draw;
+	int  min_move_count_chessboard;
+	variant_trie mate_variant;
+	variant_trie draw_variant;
+	variant_trie chessboard_variant;
+	std::string output; // variants printed by the subtree search, replayed in serial order
+	long variants_analyzed;
+	long repetition_draws;
+	long transposition_hits;
+	long transposition_misses;
+	long transposition_overwrites;
+	long heap_allocations;
 };
 
 
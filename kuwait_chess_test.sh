@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# kuwait_chess_test.sh
+#
+#  Regression test: the search threads (-j) must give the same solutions as the serial search.
+#  Only the solutions and their move count are compared, the statistics of the two searches differ.
+#  Invalid FEN texts must be rejected before any search.
+#
+#  Usage: ./kuwait_chess_test.sh [kc]   (kuwait_chess.cpp is built if the program is not given)
+#
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+KC=$1
+if [ -z "$KC" ]; then
+	KC=$DIR/kc
+	g++ -O2 -pthread "$(dirname "$0")/kuwait_chess.cpp" -o "$KC" || exit 1
+fi
+
+POSITIONS=(
+	"-i 7k/8/8/6K1/8/8/8/1R6 -m -n 3"
+	"-i k7/8/2K5/8/8/8/8/7R -m -n 3"
+	"-i 8/8/8/8/8/5K2/7R/6k1 -m -n 3"
+	"-i 6k1/5ppp/8/8/8/8/5PPP/R5K1 -m -n 3"
+	"-i 2bqkbn1/2pppp2/np2N3/r3P1p1/p2N2B1/5Q2/PPPPKPP1/RNB2r2 -m -n 2"
+	"-i 7k/5Q2/8/8/8/8/8/K7 -d -n 2"
+	"-i 1k6/8/8/8/8/8/R6R/1N1K1N2 -d -n 2"
+	"-f r1bqkbnr/1ppp1ppp/p1n5/1B2p3/4P3/5N2/PPPP1PPP/RNBQK2R -n 3"
+)
+
+solutions()
+{
+	# Solutions in the results file, and their count and move count from the final statistics
+	sed -n 's/.*\(solutions: [0-9,]*\)   \(Move count: [0-9]*\)\{0,1\}.*/\1 \2/p;/^([0-9]*) /p' "$1"
+}
+
+failures=0
+for position in "${POSITIONS[@]}"
+do
+	for threads in 1 4
+	do
+		rm -f "$DIR/j$threads.txt"
+		$KC $position -j $threads -v 0 -r "$DIR/j$threads.txt" > /dev/null 2>&1
+	done
+
+	if [ -s "$DIR/j1.txt" ] && diff <(solutions "$DIR/j1.txt") <(solutions "$DIR/j4.txt") > /dev/null
+	then
+		echo "ok      $position"
+	else
+		echo "FAILED  $position"
+		failures=$((failures + 1))
+	fi
+done
+
+BAD_FENS=(
+	"7k/8/6K1/8/8/8/8/1R6 w - - 0 -3"
+	"7k/8/6K1/8/8/8/8/1R6 w - - -1 1"
+	"7k/8/6K1/8/8/8/8/1R6 w - - x 1"
+	"7k/8/6K1/8/8/8/8/1R6 w - - 0 1 9"
+)
+
+for fen in "${BAD_FENS[@]}"
+do
+	rm -f "$DIR/bad.txt"
+	$KC -i "$fen" -m -n 2 -v 0 -r "$DIR/bad.txt" > /dev/null 2>&1
+	if [ $? -eq 2 ] && [ ! -e "$DIR/bad.txt" ]
+	then
+		echo "ok      -i \"$fen\""
+	else
+		echo "FAILED  -i \"$fen\""
+		failures=$((failures + 1))
+	fi
+done
+
+exit $failures